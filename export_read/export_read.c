@@ -0,0 +1,107 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include "../producer_consumer_export.h"
+
+/* usage: export_read [-n records] [-i idle ms]
+   Prints every record the consumers write to the export ring, one line each:
+       consumer pid uid elapsed_ns cpu_ns
+   The module has to be loaded with exportSize=N. Stops after -n records,
+   after -i ms without any new record, or when the module is unloaded.
+   Records the module had to drop because we were too slow are reported on
+   stderr at the end. See producer_consumer_export.h for the layout.
+*/
+
+#define EXPORT_PATH "/proc/producer_consumer_export"
+
+int main(int argc, char *argv[])
+{
+	long long limit = -1, count = 0, lost = 0;
+	int idle = -1; // poll timeout, -1 = wait forever
+	int opt, fd;
+	struct pc_export_info info;
+	struct pollfd pfd;
+	char *map;
+	size_t len;
+
+	while ((opt = getopt(argc, argv, "n:i:")) != -1)
+	{
+		if (opt == 'n')
+			limit = atoll(optarg);
+		else if (opt == 'i')
+			idle = atoi(optarg);
+		else
+		{
+			fprintf(stderr, "usage: export_read [-n records] [-i idle ms]\n");
+			return 1;
+		}
+	}
+
+	fd = open(EXPORT_PATH, O_RDWR); // read-write, we store tail in the mapping
+	if (fd < 0)
+	{
+		perror(EXPORT_PATH);
+		return 1;
+	}
+	map = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0); // just the info page first
+	if (map == MAP_FAILED)
+	{
+		perror("mmap");
+		return 1;
+	}
+	memcpy(&info, map, sizeof(info));
+	munmap(map, sysconf(_SC_PAGESIZE));
+	if (info.magic != PC_EXPORT_MAGIC || info.recordSize != sizeof(struct pc_export_record))
+	{
+		fprintf(stderr, "%s: unexpected layout\n", EXPORT_PATH);
+		return 1;
+	}
+	len = info.ringOffset + info.rings * info.ringStride;
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+	{
+		perror("mmap");
+		return 1;
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (limit < 0 || count < limit)
+	{
+		int got = 0;
+
+		for (unsigned int r = 0; r < info.rings && (limit < 0 || count < limit); r++)
+		{
+			char *ring = map + info.ringOffset + r * info.ringStride;
+			struct pc_export_ring_header *h = (struct pc_export_ring_header *)ring;
+			struct pc_export_record *records = (struct pc_export_record *)(ring + info.recordOffset);
+			__u64 head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE); // records below head are complete
+			__u64 tail = h->tail;
+
+			for (; tail != head && (limit < 0 || count < limit); tail++, count++, got++)
+			{
+				struct pc_export_record *rec = &records[tail & (info.records - 1)];
+				printf("%u %d %u %llu %llu\n", rec->consumer, rec->pid, rec->uid,
+					(unsigned long long)rec->elapsed_ns, (unsigned long long)rec->cpu_ns);
+			}
+			__atomic_store_n(&h->tail, tail, __ATOMIC_RELEASE); // the module may reuse them now
+		}
+		if (got)
+			continue;
+		if (poll(&pfd, 1, idle) <= 0 || (pfd.revents & (POLLHUP | POLLERR))) // idle, or unloading
+			break;
+	}
+
+	for (unsigned int r = 0; r < info.rings; r++)
+		lost += ((struct pc_export_ring_header *)(map + info.ringOffset + r * info.ringStride))->lost;
+	if (lost)
+		fprintf(stderr, "export_read: the module dropped %lld records, the rings were full\n", lost);
+	munmap(map, len);
+	close(fd);
+	return 0;
+}
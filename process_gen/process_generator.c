@@ -5,8 +5,41 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <math.h>
+#include <signal.h>
+
+/* usage: process_generator [-n count] [-r rate] [-t fanout] [-l]
+          process_generator -c target [-r rate] [-x rate] [-L ms] [-D exp|uniform|fixed] [-T seconds] [-o log]
+	-n count   how many processes to start (default: the number in the var file)
+	-r rate    start at most rate processes per second (default: batches with a sleep(1), like test.sh expects)
+	-t fanout  fork-tree mode, every process forks up to fanout children of its own so the tree grows in parallel
+	-l         lightweight children, clone(CLONE_VM) on a small stack so a child costs no page tables of its own
+   Without any options it behaves exactly like before.
+
+   Churn mode (-c) keeps a changing population around instead of a fixed one:
+	-c target  steady-state population, we only spawn while fewer children than this are alive
+	-r rate    spawns per second (default 100)
+	-x rate    kill the oldest child this many times per second on top of the lifetimes (default 0)
+	-L ms      mean lifetime of a child, 0 = lives until it is killed or we stop (default 1000)
+	-D dist    how lifetimes are drawn around the mean: exp (default), uniform (0 to 2x) or fixed
+	-T seconds stop after this long, kill the rest and exit (default 0 = until SIGTERM/SIGINT)
+	-o log     event log (default stdout), one line per event:
+	               <CLOCK_MONOTONIC ns> spawn <pid> lifetime_ns <ns>
+	               <CLOCK_MONOTONIC ns> exit <pid> alive_ns <ns>
+	               <CLOCK_MONOTONIC ns> kill <pid> alive_ns <ns>
+	           the clock is the one task start_time and ktime_get_ns() use, so the times
+	           line up with the module's
+*/
+
+#define CHILD_STACK (16 * 1024)
 
 int no_of_process=1;
+int lightweight = 0;
 
 int get_batch_size(int nprocesses)
 {
@@ -21,7 +54,6 @@ int get_batch_size(int nprocesses)
 void create_batch_process(int nprocesses)
 {
     pid_t pid;
-    int status = -1;
     while(nprocesses > 0)
     {
 
@@ -58,19 +90,360 @@ void create_process(int nprocesses, int batch_size)
 		create_batch_process(left_over);
 }
 
-int main(int argc, char *argv[])
+// the number of nanoseconds since some fixed point
+long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// sleeps until the absolute CLOCK_MONOTONIC time in ns
+void sleep_until(long long ns)
+{
+	struct timespec ts = { ns / 1000000000LL, ns % 1000000000LL };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+		;
+}
+
+// a lightweight child shares our memory, so no stdio in here, only write()
+int lightweight_child(void *arg)
+{
+	char line[64];
+	int len = snprintf(line, sizeof(line), "UID:%d Process-%ld Pid %d\n", getuid(), (long)arg, getpid());
+	write(STDOUT_FILENO, line, len);
+	for (;;)
+		pause();
+	return 0;
+}
+
+// starts one child that just sits there, returns its pid or -1
+pid_t spawn_child(void)
+{
+	static char *stacks = NULL;
+	static int stacks_left = 0;
+	pid_t pid;
+
+	if (lightweight)
+	{
+		if (stacks_left == 0) // grab stacks in big chunks, only the pages a child touches get used
+		{
+			stacks = mmap(NULL, 1024 * CHILD_STACK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (stacks == MAP_FAILED)
+				return -1;
+			stacks_left = 1024;
+		}
+		stacks_left--;
+		stacks += CHILD_STACK;
+		return clone(lightweight_child, stacks, CLONE_VM | SIGCHLD, (void *)(long)no_of_process++); // stacks grow down, so pass the top
+	}
+	if ((pid = fork()) == 0)
+	{
+		printf("UID:%d Process-%d Pid %d\n", getuid(), no_of_process, getpid());
+		fflush(stdout);
+		for (;;)
+			pause();
+	}
+	if (pid > 0)
+		no_of_process++;
+	return pid;
+}
+
+// one process after the other, at most rate per second (0 = as fast as we can)
+void create_process_rate(int nprocesses, int rate)
+{
+	long long start = now_ns();
+
+	for (int i = 0; i < nprocesses; )
+	{
+		if (rate > 0)
+			sleep_until(start + (long long)i * 1000000000LL / rate);
+		if (spawn_child() > 0)
+			i++;
+	}
+}
+
+/* fork-tree mode: we are process number first-1 and have to create nprocesses
+   below us. We fork up to fanout children, split the work between them and
+   every child does the same with its share, so all the forks of one level
+   happen in parallel. Everybody pauses once its part of the tree exists. */
+void create_process_tree(int first, int nprocesses, int fanout)
+{
+	int children = nprocesses < fanout ? nprocesses : fanout;
+
+	for (int i = 0; i < children; i++)
+	{
+		int share = nprocesses / children + (i < nprocesses % children); // this child plus everything below it
+		pid_t pid = fork();
+
+		if (pid == 0)
+		{
+			printf("UID:%d Process-%d Pid %d\n", getuid(), first, getpid());
+			fflush(stdout);
+			create_process_tree(first + 1, share - 1, fanout);
+			for (;;)
+				pause();
+		}
+		if (pid < 0) // out of processes, the rest of this subtree can't happen
+			return;
+		first += share;
+	}
+}
+
+/* Churn ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+   Lifetimes are drawn by us before the fork, the child only sleeps that long
+   and exits. spawned[pid] is when a child we still think is alive started
+   (0 = not ours or gone), order[] is every pid in spawn order so -x can find
+   the oldest one without searching. */
+struct churn {
+	int target, rate, kill_rate, mean_ms, seconds;
+	char dist;
+	FILE *log;
+	long long *spawned; // indexed by pid, pid_max entries
+	int pid_max;
+	pid_t *order; // ring of spawned pids, oldest at order_head
+	long order_head, order_tail, order_size;
+	int alive;
+};
+
+volatile sig_atomic_t churn_stop = 0;
+
+void churn_signal(int sig __attribute__((unused)))
+{
+	churn_stop = 1;
+}
+
+int read_pid_max(void)
+{
+	FILE *fp = fopen("/proc/sys/kernel/pid_max", "r");
+	int n = 4194304; // the largest pid_max there is
+
+	if (fp)
+	{
+		if (fscanf(fp, "%d", &n) != 1)
+			n = 4194304;
+		fclose(fp);
+	}
+	return n;
+}
+
+long long draw_lifetime_ns(struct churn *c)
+{
+	double mean = c->mean_ms * 1000000.0;
+
+	if (c->mean_ms == 0)
+		return 0;
+	switch (c->dist)
+	{
+	case 'u': return (long long)(drand48() * 2 * mean);
+	case 'f': return (long long)mean;
+	default: return (long long)(-mean * log(1.0 - drand48())); // exponential
+	}
+}
+
+void churn_spawn(struct churn *c)
+{
+	long long lifetime = draw_lifetime_ns(c);
+	long long start = now_ns();
+	pid_t pid = fork();
+
+	if (pid == 0)
+	{
+		struct timespec ts = { lifetime / 1000000000LL, lifetime % 1000000000LL };
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		if (lifetime == 0)
+			for (;;)
+				pause();
+		nanosleep(&ts, NULL);
+		_exit(0);
+	}
+	if (pid < 0 || pid >= c->pid_max)
+		return;
+	c->spawned[pid] = start;
+	c->order[c->order_tail++ % c->order_size] = pid;
+	if (c->order_tail - c->order_head > c->order_size) // ring lapped the oldest, forget it for -x
+		c->order_head = c->order_tail - c->order_size;
+	c->alive++;
+	fprintf(c->log, "%lld spawn %d lifetime_ns %lld\n", start, pid, lifetime);
+}
+
+// one event line for a child that is gone, what = "exit" or "kill"
+void churn_gone(struct churn *c, pid_t pid, const char *what)
+{
+	long long now = now_ns();
+
+	if (pid <= 0 || pid >= c->pid_max || c->spawned[pid] == 0)
+		return;
+	fprintf(c->log, "%lld %s %d alive_ns %lld\n", now, what, pid, now - c->spawned[pid]);
+	c->spawned[pid] = 0;
+	c->alive--;
+}
+
+void churn_reap(struct churn *c)
+{
+	pid_t pid;
+
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+		churn_gone(c, pid, "exit");
+}
+
+void churn_kill_oldest(struct churn *c)
+{
+	while (c->order_head < c->order_tail)
+	{
+		pid_t pid = c->order[c->order_head++ % c->order_size];
+		if (c->spawned[pid] == 0) // already exited on its own
+			continue;
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		churn_gone(c, pid, "kill");
+		return;
+	}
+}
+
+int churn_run(struct churn *c)
+{
+	long long start = now_ns();
+	long long end = c->seconds > 0 ? start + c->seconds * 1000000000LL : 0;
+	long long spawns = 0, kills = 0;
+
+	c->pid_max = read_pid_max();
+	c->spawned = calloc(c->pid_max, sizeof(long long));
+	c->order_size = c->target > 0 ? 4L * c->target : 1 << 20;
+	c->order = malloc(c->order_size * sizeof(pid_t));
+	if (!c->spawned || !c->order)
+	{
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	srand48(start);
+	signal(SIGTERM, churn_signal);
+	signal(SIGINT, churn_signal);
+
+	while (!churn_stop)
+	{
+		long long now = now_ns();
+		long long next_spawn = start + spawns * 1000000000LL / c->rate;
+		long long next_kill = c->kill_rate > 0 ? start + (kills + 1) * 1000000000LL / c->kill_rate : 0;
+		long long next;
+
+		if (end && now >= end)
+			break;
+		churn_reap(c);
+		if (now >= next_spawn)
+		{
+			if (c->alive < c->target)
+				churn_spawn(c);
+			spawns++; // a skipped spawn isn't made up later, we just hold at the target
+			continue;
+		}
+		if (c->kill_rate > 0 && now >= next_kill)
+		{
+			churn_kill_oldest(c);
+			kills++;
+			continue;
+		}
+		next = next_spawn;
+		if (c->kill_rate > 0 && next_kill < next)
+			next = next_kill;
+		if (next > now + 1000000) // wake up at least every ms to reap
+			next = now + 1000000;
+		sleep_until(next);
+	}
+
+	// stop: everybody left gets killed and logged
+	for (pid_t pid = 1; pid < c->pid_max && c->alive > 0; pid++)
+	{
+		if (c->spawned[pid] == 0)
+			continue;
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		churn_gone(c, pid, "kill");
+	}
+	fflush(c->log);
+	return 0;
+}
+
+int read_var_file(void)
 {
-	int num;
 	FILE *fp;
-	char buffer[10];
-	int batch_size;
-	
+	char buffer[10] = {0};
+
 	fp = fopen("var", "r");
-	fread(buffer, 10, 1, fp);
-	num         = atoi(buffer);
-	batch_size  = get_batch_size(num);
-	create_process(num, batch_size);
+	if (!fp)
+	{
+		fprintf(stderr, "no -n given and no var file to read the count from\n");
+		exit(1);
+	}
+	fread(buffer, sizeof(buffer) - 1, 1, fp);
 	fclose(fp);
+	return atoi(buffer);
+}
+
+int main(int argc, char *argv[])
+{
+	int num = -1;
+	int rate = -1; // -1 = the old batches
+	int fanout = 0;
+	int batch_size;
+	int opt;
+	struct churn churn = { .target = 0, .kill_rate = 0, .mean_ms = 1000, .dist = 'e', .log = stdout };
+
+	while ((opt = getopt(argc, argv, "n:r:t:lc:x:L:D:T:o:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n': num = atoi(optarg); break;
+		case 'r': rate = atoi(optarg); break;
+		case 't': fanout = atoi(optarg); break;
+		case 'l': lightweight = 1; break;
+		case 'c': churn.target = atoi(optarg); break;
+		case 'x': churn.kill_rate = atoi(optarg); break;
+		case 'L': churn.mean_ms = atoi(optarg); break;
+		case 'D': churn.dist = optarg[0]; break;
+		case 'T': churn.seconds = atoi(optarg); break;
+		case 'o':
+			churn.log = fopen(optarg, "w");
+			if (!churn.log)
+			{
+				perror(optarg);
+				return 1;
+			}
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n count] [-r rate] [-t fanout] [-l]\n"
+				"       %s -c target [-r rate] [-x rate] [-L ms] [-D exp|uniform|fixed] [-T seconds] [-o log]\n", argv[0], argv[0]);
+			return 1;
+		}
+	}
+	if (churn.target > 0)
+	{
+		if (fanout > 0 || lightweight)
+		{
+			fprintf(stderr, "-c can't be combined with -t or -l\n");
+			return 1;
+		}
+		churn.rate = rate > 0 ? rate : 100;
+		return churn_run(&churn);
+	}
+	if (fanout > 0 && lightweight)
+	{
+		fprintf(stderr, "-l only works without -t, clone(CLONE_VM) children can't fork a tree of their own\n");
+		return 1;
+	}
+	if (num < 0)
+		num = read_var_file();
+
+	if (fanout > 0)
+		create_process_tree(1, num, fanout);
+	else if (rate >= 0 || lightweight)
+		create_process_rate(num, rate > 0 ? rate : 0);
+	else
+	{
+		batch_size  = get_batch_size(num);
+		create_process(num, batch_size);
+	}
 	wait(NULL);
 	return 0;
 }
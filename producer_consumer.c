@@ -9,6 +9,40 @@
 #include <linux/time.h>
 #include <linux/timer.h>
 #include <linux/slab.h>
+#include <linux/wait.h>
+#include <linux/cache.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/topology.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/sched/task.h>
+#include <linux/cred.h>
+#include <linux/list.h>
+#include <linux/hashtable.h>
+#include <linux/jiffies.h>
+#include <linux/sort.h>
+#include <linux/hash.h>
+#include <linux/rcupdate.h>
+#include <linux/pid.h>
+#include <linux/pid_namespace.h>
+#include <linux/cpumask.h>
+#include <linux/atomic.h>
+#include <linux/poll.h>
+#include <linux/fs.h>
+#include <linux/sched/mm.h>
+#include <linux/sched/signal.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+#include <linux/seqlock.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/tracepoint.h>
+
+#define CREATE_TRACE_POINTS
+#include "producer_consumer_trace.h"
+#include "producer_consumer_export.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("B.O.S.N.");
@@ -18,10 +52,32 @@ MODULE_DESCRIPTION("Solving the Producer Consumer problem using semaphores");
     Reference: https://www.hitchhikersguidetolearning.com/2018/10/24/passing-data-to-a-kernel-module-module_param/
 
     Parameters:
-        buffSize: Size of the buffer
-        prod: Number of producers (0 o 1)
-        cons: Number of consumers (a non-negative integer)
+        buffSize: Size of the buffer (can be changed while loaded with ringMode 0, see Runtime resizing)
+        pow2Ring: 1 = allocate the ring rounded up to a power of two and index it with a mask (still holds at most buffSize)
+        prod: Number of producers (a non-negative integer, each one scans its own shard of PIDs)
+        cons: Number of consumers (a non-negative integer, can be changed while loaded up to consMax)
+        consMax: most consumers cons can be raised to while loaded (default: cons at load)
         uuid: the uuid of the user
+        uids: a list of uids to account in the same pass instead of uuid (uids=1000,1001,...)
+        allUids: 1 = account every process, totals per uid
+        ringMode: which buffer implementation to use (0 = semaphores, 1 = lock-free ring, 2 = a lock-free ring per consumer with work stealing)
+        batch: max items moved per critical section (1 = one at a time like before)
+        waitMode: what a thread does when the buffer is empty/full (0 = sleep, 1 = spin then sleep, 2 = adaptive spin then sleep)
+        spinNs: longest a thread spins before it goes to sleep (waitMode 1 and 2)
+        snapshot: 0 = slots keep a referenced task_struct pointer, 1 = slots only hold copied fields
+        scanInterval: 0 = scan the process list once, N = rescan every N ms and produce only new tasks
+        rcuWalk: 1 = one-shot scan walks PIDs in short RCU chunks and never sleeps inside the walk
+        prodCpus: CPU list to pin producers to (like "0-3,8"), thread N goes on the Nth CPU, wrapping around
+        consCpus: CPU list to pin consumers to
+        numaBuffer: 1 = allocate the buffer on the NUMA node of Producer-1's CPU
+        logMode: 0 = printk every item, 1 = binary records in a per-CPU trace buffer
+        traceSize: records each CPU's trace buffer can hold (logMode 1)
+        rawNs: 1 = print elapsed times as plain nanoseconds instead of HH:MM:SS
+        cpuTime: 1 = also add up the CPU time (utime + stime of all its threads) of every consumed task, per uid too
+        topK: N = keep the N longest running consumed processes and list them at exit and in /proc (handler elapsed only)
+        exportSize: N = every consumer also writes its items to a ring of N records userspace can mmap from /proc/producer_consumer_export (max 1048576)
+        handler: what consumers do with each item ("elapsed" = add up elapsed time like before, "rss" = add up resident memory, not with topK, uids, allUids or cpuTime)
+        bench: N = produce N synthetic items instead of walking the process list and report throughput when they are consumed
 
     I'm not 100% sure what the permissions should be so I will try 0644 since that's
     what the article uses.
@@ -37,20 +93,37 @@ MODULE_DESCRIPTION("Solving the Producer Consumer problem using semaphores");
 //when we made the module we set these params
 
 // Buffer size
+// writing it while loaded resizes the buffer, see Runtime resizing
 static int buffSize = 10;
-module_param(buffSize, int, 0644);
+static int buff_size_set(const char *val, const struct kernel_param *kp);
+static const struct kernel_param_ops buffSizeOps = { .set = buff_size_set, .get = param_get_int };
+module_param_cb(buffSize, &buffSizeOps, &buffSize, 0644);
 MODULE_PARM_DESC(buffSize, "Size of the buffer");
 
+// Power of two ring
+// slot = pos & mask instead of pos % buffSize, the capacity is still buffSize
+static int pow2Ring = 0;
+module_param(pow2Ring, int, 0444); //read only, the buffer is laid out for it at load
+MODULE_PARM_DESC(pow2Ring, "1 = round the ring up to a power of two and index it with a mask");
+
 // Number of producers
 static int prod = 1;
-module_param(prod, int, 0644);
-MODULE_PARM_DESC(prod, "Number of producers (0 or 1)");
+module_param(prod, int, 0444); //read only, it is the PID shard divisor and the size of the producer arrays
+MODULE_PARM_DESC(prod, "Number of producers (a non-negative integer)");
 
 // Number of consumers
+// writing it while loaded starts or stops consumers, see Runtime resizing
 static int cons = 1;
-module_param(cons, int, 0644);
+static int cons_set(const char *val, const struct kernel_param *kp);
+static const struct kernel_param_ops consOps = { .set = cons_set, .get = param_get_int };
+module_param_cb(cons, &consOps, &cons, 0644);
 MODULE_PARM_DESC(cons, "Number of consumers (a non-negative integer)");
 
+// Consumer limit
+static int consMax = 0;
+module_param(consMax, int, 0444); //read only, the consumer contexts are allocated for it at load
+MODULE_PARM_DESC(consMax, "Most consumers cons can be raised to at runtime (0 = cons at load)");
+
 // User UUID
 // not sure of the type UUID should be but I will try unsigned int
 // https://en.wikipedia.org/wiki/User_identifier?#Type
@@ -58,6 +131,133 @@ static uint uuid = 0;
 module_param(uuid, uint, 0644);
 MODULE_PARM_DESC(uuid, "The uuid of the user");
 
+// UID list
+// lets one pass over the process list account many users instead of one insmod per user
+#define MAX_UIDS 64
+static uint uids[MAX_UIDS];
+static int nrUids = 0;
+module_param_array(uids, uint, &nrUids, 0444); //read only, sorted once at load for the binary search
+MODULE_PARM_DESC(uids, "Comma separated list of uids to account instead of uuid (up to 64)");
+
+// All UIDs
+static int allUids = 0;
+module_param(allUids, int, 0444);
+MODULE_PARM_DESC(allUids, "1 = account every process and keep totals per uid");
+
+// Ring mode
+// lets us A/B the original semaphore buffer against the lock-free ring below
+#define RING_SEMAPHORE 0
+#define RING_LOCKFREE 1
+#define RING_SHARDED 2
+static int ringMode = RING_SEMAPHORE;
+module_param(ringMode, int, 0444); //read only, the buffer is laid out for one mode at load
+MODULE_PARM_DESC(ringMode, "Buffer implementation (0 = semaphores, 1 = lock-free ring, 2 = per-consumer sub-rings)");
+
+// Batch size
+// the producer publishes and each consumer drains up to this many items per lock/wakeup
+static int batch = 1;
+module_param(batch, int, 0444); //read only, the batch arrays are sized from it at load
+MODULE_PARM_DESC(batch, "Max items moved per critical section (a positive integer)");
+
+// Wait strategy
+// sleeping on an empty buffer costs a context switch for every wakeup, spinning a bit
+// first is cheaper when the next item is only a few microseconds away
+#define WAIT_SLEEP 0
+#define WAIT_SPIN 1
+#define WAIT_ADAPTIVE 2
+static int waitMode = WAIT_SLEEP;
+module_param(waitMode, int, 0644);
+MODULE_PARM_DESC(waitMode, "0 = sleep right away, 1 = spin up to spinNs then sleep, 2 = spin as long as recent waits took (up to spinNs) then sleep");
+
+static uint spinNs = 20000;
+module_param(spinNs, uint, 0644);
+MODULE_PARM_DESC(spinNs, "Max ns to spin before sleeping (waitMode 1 and 2)");
+
+// Snapshot mode
+// 1 = the producer copies pid/uid/start_time into the slot and forgets the task, so
+// consumers never touch a task_struct and it doesn't matter if the task exits
+static int snapshot = 0;
+module_param(snapshot, int, 0444); //read only, changing it with items in flight would leak references
+MODULE_PARM_DESC(snapshot, "0 = slots hold a referenced task pointer, 1 = slots hold only copied fields");
+
+// Scan interval
+// with this set the producers keep running and pick up tasks created since their last pass
+static int scanInterval = 0;
+module_param(scanInterval, int, 0444); //read only, exit has to know whether producers are still running
+MODULE_PARM_DESC(scanInterval, "0 = scan once, N = rescan the process list every N ms for new tasks");
+
+// RCU walk
+// the old walk does for_each_process with no rcu_read_lock and sleeps in the middle of it
+static int rcuWalk = 0;
+module_param(rcuWalk, int, 0644);
+MODULE_PARM_DESC(rcuWalk, "1 = collect tasks in short RCU read-side chunks and publish them outside the lock");
+
+// CPU placement
+// unpinned threads get moved around by the scheduler and drag the ring's cachelines between sockets
+static char *prodCpus = NULL;
+module_param(prodCpus, charp, 0444);
+MODULE_PARM_DESC(prodCpus, "CPU list to pin producers to, e.g. 0-3,8 (default: not pinned)");
+
+static char *consCpus = NULL;
+module_param(consCpus, charp, 0444);
+MODULE_PARM_DESC(consCpus, "CPU list to pin consumers to, e.g. 4-7 (default: not pinned)");
+
+static int numaBuffer = 0;
+module_param(numaBuffer, int, 0444);
+MODULE_PARM_DESC(numaBuffer, "1 = allocate the buffer on Producer-1's NUMA node");
+
+// Log mode
+// printk goes through the console/log path, which is slow to do per item while holding
+// the mutex, so there is a trace buffer that gets formatted when /proc is read instead
+#define LOG_PRINTK 0
+#define LOG_TRACE 1
+static int logMode = LOG_PRINTK;
+module_param(logMode, int, 0444); //read only, the trace buffers only exist if it was 1 at load
+MODULE_PARM_DESC(logMode, "0 = printk each item, 1 = per-CPU trace buffer read through /proc/producer_consumer_trace");
+
+// Trace buffer size
+static int traceSize = 4096;
+module_param(traceSize, int, 0444); //read only, the buffers are sized from it at load
+MODULE_PARM_DESC(traceSize, "Records per CPU in the trace buffer (logMode=1)");
+
+// Raw time output
+// HH:MM:SS only has second resolution, scripts can ask for the nanoseconds instead
+static int rawNs = 0;
+module_param(rawNs, int, 0644);
+MODULE_PARM_DESC(rawNs, "1 = elapsed times are printed as nanoseconds, 0 = HH:MM:SS");
+
+// CPU time
+// elapsed time is only how long ago a task started, this is how long it actually ran
+static int cpuTime = 0;
+module_param(cpuTime, int, 0444); //read only, the slots are filled according to it
+MODULE_PARM_DESC(cpuTime, "1 = also account utime + stime of each consumed task, 0 = elapsed time only");
+
+// Top-K
+// the summed elapsed time doesn't say which processes make it up
+#define TOPK_MAX 1024
+static int topK = 0;
+module_param(topK, int, 0444); //read only, the heaps are sized from it at load
+MODULE_PARM_DESC(topK, "0 = off, N = track the N longest running consumed processes (max 1024)");
+
+// Export ring
+// per item records for userspace without going through printk, see Export ring
+#define EXPORT_MAX (1 << 20) //records per ring, 32 MB of them
+static int exportSize = 0;
+module_param(exportSize, int, 0444); //read only, the rings are sized from it at load
+MODULE_PARM_DESC(exportSize, "0 = off, N = records per consumer in the mmap-able /proc/producer_consumer_export (rounded up to a power of two, max 1048576)");
+
+// Consumer handler
+// picked by name at load, see Consumer handlers
+static char *handler = "elapsed";
+module_param(handler, charp, 0444);
+MODULE_PARM_DESC(handler, "What consumers do with each item: elapsed (default) or rss");
+
+// Bench mode
+// spawning real processes mostly measures fork, this only measures the buffer
+static int bench = 0;
+module_param(bench, int, 0444); //read only, slots can't hold task references in bench mode
+MODULE_PARM_DESC(bench, "0 = normal run, N = push N synthetic items through the buffer and report items/sec (no per-item printk)");
+
 // Semaphores ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 static struct semaphore empty;  //when 0 cannot add any more
 static struct semaphore full;   //when full is 0, cannot take any
@@ -66,17 +266,39 @@ static struct semaphore mutex; //lock
 // Threads ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 static int kthread_producer(void *arg);
 static int kthread_consumer(void *arg);
+static void stop_all_threads(void); //see Teardown, init uses it to unwind too
+static void fork_probe_init(void); //see Continuous scanning
+static void fork_probe_exit(void);
 
 // Thread variables ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-static struct task_struct *producerThread = NULL;
+static struct task_struct **producerThreads = NULL;
 static struct task_struct **consumerThreads = NULL;
+static bool stopping = false; //set once by exit, every wait and loop checks it (see Teardown)
+static int consSeen = 0; //consumer contexts that ever had a thread, what the stats add up (see Runtime resizing)
+static DEFINE_SPINLOCK(consLock); //cons against a consumer deciding to retire
+static atomic_t retireWakes = ATOMIC_INIT(0); //ups of full from a cons drop, no item behind them (see Runtime resizing)
+static DEFINE_MUTEX(resizeMutex); //one parameter write at a time, and none during init or exit
+static bool initStarted = false; //before this, parameter writes are just load time parsing
+static bool resizeReady = false; //between the end of init and the start of exit
+
+// true once the module is going away
+static bool pc_should_stop(void){
+    return READ_ONCE(stopping) || kthread_should_stop();
+}
 
 
 /* Buffer ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
     I'm thinking of using a circular buffer by using an array of
-    size buffSize that stores task_struct pointers and two integers
+    size buffSize that stores task records (see Slot records) and two integers
     that indicate the head and tail of the buffer.
 
+    head and tail are free-running counters (headCount/tailCount), so the
+    occupancy is just tailCount - headCount and pos is in slot pos % buffSize.
+    With pow2Ring the array gets rounded up to a power of two and the slot is
+    pos & ringMask, no division. The semaphores still only let buffSize items
+    in, the extra slots are just never all in use at once. The buffer index
+    in the log then goes up to the rounded size, not buffSize.
+
     task_struct reference:
         https://docs.huihoo.com/doxygen/linux/kernel/3.7/structtask__struct.html
         task_struct->cred.uid.val is the user id of the task
@@ -84,176 +306,2904 @@ static struct task_struct **consumerThreads = NULL;
         task_struct->start_time is the time the task started
 
 */
-static struct task_struct **buffer; //array of task structs which is why double pointer, circular
-static int head = 0; //to keep track of where we remove
-static int tail = 0; //to keep track of where we add
+/* Slot records ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    Instead of just the task_struct pointer every slot keeps what the consumer
+    needs copied from the task when it was produced, plus when it went in.
+    The consumer never has to touch the (by then cold) task_struct and we can
+    measure how long items sit in the buffer.
 
-static int totalConsumed = 0; //totalConsumed is number of processes consumed
-static long totalProcessNanoseconds = 0; //keeps track of time of all consumed processes
+    With snapshot 0 the slot also keeps the task pointer, and the producer takes
+    a reference (get_task_struct) so the pointer stays valid even if the task
+    exits before it is consumed. The consumer drops it when it is done. With
+    snapshot 1 the pointer is replaced by the uid and there are no references
+    at all; everything a consumer needs is in the ring.
 
+    With cpuTime the CPU time is read when the item is consumed, the same
+    moment the elapsed time is taken. Without a task pointer (snapshot 1) that
+    isn't possible, so the producer copies it in next to the uid, in the half
+    of the union the pointer would use. It only gets 32 bits there, so it is
+    kept in ms (49 days before it saturates). With tick based accounting
+    utime/stime only move a whole tick at a time anyway.
 
-// Module initializer ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-static int __init producer_consumer_init(void){
-    printk(KERN_INFO "producer_consumer module loaded\n"); //just left for testing
+    32 bytes and 32 byte aligned, so two slots share a cacheline and one slot
+    never straddles two. The timestamp costs no extra misses per item.
+*/
+struct pc_slot {
+    u32 seq; //lock-free ring only, which lap the cell is on (see Lock-free ring)
+    pid_t pid; //task->pid
+    u64 start_time; //task->start_time
+    u64 enqueue_ns; //ktime_get_ns() when it was put in the buffer
+    union {
+        struct task_struct *task; //snapshot 0, we hold a reference on it
+        struct { //snapshot 1
+            uid_t uid; //task's uid when it was produced
+            u32 cpu_ms; //cpuTime, utime + stime when it was produced
+        };
+    };
+} __aligned(32);
 
-    /* printed out the parameters for testing
-    printk(KERN_INFO "buffSize: %d\n", buffSize);
-    printk(KERN_INFO "prod: %d\n", prod);
-    printk(KERN_INFO "cons: %d\n", cons);
-    printk(KERN_INFO "uuid: %u\n", uuid);
+static struct pc_slot *buffer; //array of slots, circular
+static unsigned long ringMask = 0; //ring size - 1 with pow2Ring
+static unsigned long headCount = 0; //how many items were ever taken from head, gives us the Item# of each one
+static unsigned long tailCount = 0; //how many items were ever added at tail, tailCount - headCount is the occupancy
 
-    Testing passed!
-    */
+// how many slots a ring holding capacity items gets
+static unsigned long ring_cells(unsigned long capacity){
+    return pow2Ring ? roundup_pow_of_two(capacity) : capacity;
+}
 
-    //Not required, but I am going to check some edge cases 
-    //and throw an error if they occur
-    if(buffSize < 1){
-        printk(KERN_ERR "buffSize must be greater than 0\n");
-        return -1;
+// slot of free-running position pos in a ring of size slots, mask is size - 1 with pow2Ring
+static inline unsigned long ring_wrap(unsigned long pos, unsigned long size, unsigned long mask){
+    if(pow2Ring)
+        return pos & mask;
+    return pos % size;
+}
+
+// slot of pos in the whole-buffer rings (ringMode 0 and 1)
+static inline unsigned long buffer_slot(unsigned long pos){
+    return ring_wrap(pos, buffSize, ringMask);
+}
+
+/* Thread statistics ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    Each thread adds up its own totals so nothing shared gets written per item
+    and the accounting can happen after the mutex is released.
+    producer_consumer_exit folds them together once the threads are stopped.
+
+    Every counter has exactly one writer, which uses WRITE_ONCE, so
+    /proc/producer_consumer can read them with READ_ONCE while the threads run
+    without taking any lock.
+*/
+#define HIST_BUCKETS 64 //log2 buckets, bucket b counts values in [2^(b-1), 2^b)
+
+// queue latency gets a finer log-linear histogram so we can pull percentiles out of it:
+// every power of two is split into LAT_SUB buckets, which is within 12.5%
+#define LAT_SUB_BITS 3
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS ((64 - LAT_SUB_BITS + 1) * LAT_SUB)
+
+// one per thread, only that thread writes it
+struct pc_wait {
+    u64 avgNs; //moving average of how long our recent waits took (waitMode 2)
+    u64 spun; //waits that ended while we were still spinning
+    u64 slept; //waits that had to sleep
+};
+
+struct consumer_stats {
+    char name[20]; //Consumer-N, also the thread name
+    int id; //the N in Consumer-N
+    struct pc_slot *slots; //the batch we took, from threadPool
+    unsigned long *positions; //and where each one came from
+    u64 consumed; //number of processes this consumer took
+    u64 nanoseconds; //elapsed time of those processes
+    u64 cpuNanoseconds; //and their CPU time (cpuTime)
+    u64 elapsedHist[HIST_BUCKETS]; //elapsed time of each process
+    u64 latencyHist[LAT_BUCKETS]; //time each item spent in the buffer
+    u64 rssPages; //resident pages of those processes (handler rss)
+    u64 rssMax; //the largest one
+    struct top_task *top; //min-heap of the topK longest running ones we consumed, from threadPool
+    int nTop; //entries in top
+    seqcount_t topSeq; //lets /proc copy top while we change it
+    struct pc_export_ring_header *exportHeader; //our export ring, NULL without exportSize
+    struct pc_export_record *exportRecords;
+    u64 exportHead; //our own copy of head, the one in the ring could have been scribbled on
+    u64 exportLost;
+    struct uid_total *uidTotals; //per uid totals, only with uids/allUids
+    u64 otherConsumed; //uids that didn't fit in uidTotals
+    u64 otherNanoseconds;
+    u64 otherCpuNanoseconds;
+    u64 stolen; //items taken from another consumer's sub-ring (ringMode 2)
+    bool retired; //exited because cons went below our id, under consLock (see Runtime resizing)
+    struct pc_wait wait; //waiting for items
+} ____cacheline_aligned_in_smp; //own cachelines per consumer so the counters don't bounce
+
+struct producer_stats {
+    u64 produced; //items this producer put in the buffer
+    int nextRing; //sub-ring the next item goes to (ringMode 2)
+    struct task_struct **pending; //tasks found but not published yet, from threadPool
+    struct task_struct **held; //tasks picked up by the current RCU chunk (rcuWalk)
+    struct pc_wait wait; //waiting for free slots
+    spinlock_t forkLock; //the fork probe adds to forked, this producer takes (scanInterval)
+    struct task_struct **forked; //SCAN_QUEUE of them from threadPool, each holds a reference
+    int nforked;
+    bool forkOverflow; //the probe had to drop some, the next pass walks the list
+} ____cacheline_aligned_in_smp;
+
+static struct consumer_stats *consumerStats = NULL;
+static struct producer_stats *producerStats = NULL;
+static u64 startNs; //when the module loaded, for throughput
+
+static void hist_add(u64 *hist, u64 value){
+    int b = fls64(value); //0 only for value 0
+    if(b >= HIST_BUCKETS)
+        b = HIST_BUCKETS - 1;
+    WRITE_ONCE(hist[b], hist[b] + 1);
+}
+
+static int lat_bucket(u64 value){
+    int msb;
+    if(value < LAT_SUB)
+        return value;
+    msb = fls64(value) - 1;
+    return (msb - LAT_SUB_BITS + 1) * LAT_SUB + ((value >> (msb - LAT_SUB_BITS)) & (LAT_SUB - 1));
+}
+
+// smallest value that lands in bucket b
+static u64 lat_bucket_low(int b){
+    int msb;
+    if(b < LAT_SUB)
+        return b;
+    msb = b / LAT_SUB + LAT_SUB_BITS - 1;
+    return (u64)(LAT_SUB + b % LAT_SUB) << (msb - LAT_SUB_BITS);
+}
+
+static void lat_add(u64 *hist, u64 value){
+    int b = lat_bucket(value);
+    WRITE_ONCE(hist[b], hist[b] + 1);
+}
+
+// adds every consumer's latency histogram into out, returns the number of samples
+static u64 lat_merge(u64 *out){
+    u64 total = 0;
+    memset(out, 0, LAT_BUCKETS * sizeof(u64));
+    for(int i = 0; i < consSeen; i++){
+        for(int b = 0; b < LAT_BUCKETS; b++){
+            u64 n = READ_ONCE(consumerStats[i].latencyHist[b]);
+            out[b] += n;
+            total += n;
+        }
     }
-    if(prod < 0 || prod > 1){
-        printk(KERN_ERR "prod must be 0 or 1\n");
-        return -1;
+    return total;
+}
+
+// upper bound of the bucket holding the permille-th sample (500 = p50, 999 = p999)
+static u64 lat_percentile(const u64 *hist, u64 total, int permille){
+    u64 rank = div64_u64(total * permille + 999, 1000); //ceil, so p999 of 10 samples is the 10th
+    u64 seen = 0;
+
+    if(!total)
+        return 0;
+    for(int b = 0; b < LAT_BUCKETS; b++){
+        seen += hist[b];
+        if(seen >= rank)
+            return b + 1 < LAT_BUCKETS ? lat_bucket_low(b + 1) : U64_MAX;
     }
-    if(cons < 0){
-        printk(KERN_ERR "cons must be greater than or equal to 0\n");
-        return -1;
+    return U64_MAX;
+}
+
+/* Per-UID accounting ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    With uids or allUids set the producers match many users in their one pass
+    and every consumer keeps totals per uid in its own open-addressing table,
+    so this is still lock free. Reports merge the consumer tables and sort them.
+
+    An entry is free while consumed is 0. The consumer fills in uid first and
+    then publishes the entry with a release store of consumed, so a /proc reader
+    never sees a half made entry. If allUids sees more users than the table
+    holds, the rest are added up in the consumer's "other" counters.
+*/
+#define UID_TABLE_BITS 10
+#define UID_TABLE_SIZE (1 << UID_TABLE_BITS)
+
+struct uid_total {
+    u64 consumed; //processes of this uid, 0 = entry unused
+    u64 nanoseconds; //their elapsed time
+    u64 cpuNs; //their CPU time (cpuTime)
+    uid_t uid;
+};
+
+static bool multi_uid(void){
+    return allUids || nrUids > 0;
+}
+
+static int uid_cmp(const void *a, const void *b){
+    uid_t x = *(const uid_t *)a, y = *(const uid_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// does the producer want this task
+static bool uid_wanted(uid_t uid){
+    int lo = 0, hi = nrUids - 1;
+
+    if(allUids)
+        return true;
+    if(nrUids == 0)
+        return uid == uuid;
+    while(lo <= hi){ //uids is sorted at load
+        int mid = (lo + hi) / 2;
+        if(uids[mid] == uid)
+            return true;
+        if(uids[mid] < uid)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
     }
-    
-    /* Program Flow
-        1. Initialize semaphores
-        2. Initialize buffer
-        3. Create consumers
-        4. Create producers
-        5. Wait for exit
-        6. end all threads and free memory
-    */
+    return false;
+}
 
-    // 1. Initialize semaphores ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-    sema_init(&empty, buffSize); //we make the empty the buffsize
-    sema_init(&full, 0); //we make full 0, since we can add (no slots not full)
-    sema_init(&mutex, 1); // binary semaphore set to 1 (unlocked)
+// finds uid's entry, or the free entry where it would go, NULL if the table is full
+static struct uid_total *uid_lookup(struct uid_total *table, uid_t uid){
+    u32 i = hash_32(uid, UID_TABLE_BITS);
 
-    // 2. Initialize buffer ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-    buffer = kmalloc(buffSize * sizeof(struct task_struct *), GFP_KERNEL); //we allocate memory for the buffer, we use gfp_kernel flag(normal allocation), and we allocate size of task-struct pointer * buffersize
-    if(!buffer){ //if we fail to allocate memory for buffer
-        printk(KERN_ERR "Failed to allocate memory for buffer\n");
-        return -1;
+    for(int probes = 0; probes < UID_TABLE_SIZE; probes++, i = (i + 1) & (UID_TABLE_SIZE - 1)){
+        if(!smp_load_acquire(&table[i].consumed) || table[i].uid == uid)
+            return &table[i];
     }
+    return NULL;
+}
 
-    // 3. Create Consumers ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-    if(cons > 0){
-        printk(KERN_INFO "Creating consumer threads\n"); //we need to keep track of task structs to kill them later, cannot lose(floating memory)
-        consumerThreads = kmalloc(cons * sizeof(struct task_struct *), GFP_KERNEL); //allocate the space for consumer thread
-        if(!consumerThreads){ //failed to allocate consumer thread
-            printk(KERN_ERR "Failed to allocate memory for consumer threads\n");
-            return -1;
+// single writer only (the owning consumer, or exit/proc merging into their own table)
+static bool uid_add(struct uid_total *table, uid_t uid, u64 consumed, u64 ns, u64 cpuNs){
+    struct uid_total *t = uid_lookup(table, uid);
+
+    if(!t)
+        return false;
+    if(!t->consumed){ //new entry
+        t->uid = uid;
+        t->nanoseconds = ns;
+        t->cpuNs = cpuNs;
+        smp_store_release(&t->consumed, consumed);
+        return true;
+    }
+    WRITE_ONCE(t->nanoseconds, t->nanoseconds + ns);
+    WRITE_ONCE(t->cpuNs, t->cpuNs + cpuNs);
+    WRITE_ONCE(t->consumed, t->consumed + consumed);
+    return true;
+}
+
+
+/* Lock-free ring ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    Bounded ring with a sequence number in every cell (the Vyukov MPMC queue).
+    head and tail are free-running counters and the cell is pos % size (or
+    pos & mask with pow2Ring).
+    The cells are the same buffer[] slots the semaphore mode uses; seq is a u32
+    and only ever compared as a signed difference, so it can wrap.
+
+    cell.seq == pos      -> cell is free for the producer writing position pos
+    cell.seq == pos + 1  -> cell holds the item for the consumer reading position pos
+
+    With one producer and one consumer it is SPSC and head/tail are plain
+    stores. When there are more threads on a side they race for that index
+    with cmpxchg. Nobody takes a lock; threads only sleep on the wait queues
+    when the ring is really empty or really full.
+
+    With pow2Ring there can be more cells than the ring may hold, then a
+    push also checks tail - head against the capacity. That is the only time
+    a producer reads the consumers' index.
+
+    ringMode 1 is one of these over the whole buffer. ringMode 2 cuts the
+    buffer into one ring per consumer (see Sub-rings).
+*/
+struct lf_index {
+    unsigned long pos;
+} ____cacheline_aligned_in_smp; //head and tail each get their own cacheline so they don't bounce together
+
+struct lf_ring {
+    struct pc_slot *cells; //its part of buffer[]
+    unsigned long size; //number of cells
+    unsigned long mask; //size - 1, pow2Ring only
+    unsigned long capacity; //most items it may hold, less than size if pow2Ring rounded it up
+    bool oneProducer; //nobody else pushes, tail can be a plain store
+    bool oneConsumer; //nobody else pops, head can be a plain store
+    struct lf_index head; //consumers take from here
+    struct lf_index tail; //producers add here
+    wait_queue_head_t notEmpty; //consumers sleep here when the ring is empty
+    wait_queue_head_t notFull; //producers sleep here when the ring is full
+};
+
+static struct lf_ring lfRing; //ringMode 1
+
+// how far cell's seq is from what pos expects, < 0 means not ready yet
+static s32 lf_seq_diff(struct pc_slot *cell, unsigned long expect){
+    return (s32)(smp_load_acquire(&cell->seq) - (u32)expect);
+}
+
+// cells has to have ring_cells(capacity) slots
+static void lf_init(struct lf_ring *r, struct pc_slot *cells, unsigned long capacity, bool oneProducer, bool oneConsumer){
+    unsigned long size = ring_cells(capacity);
+
+    r->cells = cells;
+    r->size = size;
+    r->mask = size - 1;
+    r->capacity = capacity;
+    r->oneProducer = oneProducer;
+    r->oneConsumer = oneConsumer;
+    for(unsigned long i = 0; i < size; i++) //every cell starts free for its first lap
+        cells[i].seq = i;
+    r->head.pos = 0;
+    r->tail.pos = 0;
+    init_waitqueue_head(&r->notEmpty);
+    init_waitqueue_head(&r->notFull);
+}
+
+// where ring position pos lives in buffer[], that's what gets logged
+static unsigned long lf_buffer_index(const struct lf_ring *r, unsigned long pos){
+    return (r->cells - buffer) + ring_wrap(pos, r->size, r->mask);
+}
+
+static struct pc_slot *lf_cell(struct lf_ring *r, unsigned long pos){
+    return &r->cells[ring_wrap(pos, r->size, r->mask)];
+}
+
+// only with pow2Ring rounding up, false if pushing at pos would go over capacity
+static bool lf_under_capacity(struct lf_ring *r, unsigned long pos){
+    if(r->capacity == r->size) //the seq numbers already stop us at size
+        return true;
+    return pos - READ_ONCE(r->head.pos) < r->capacity; //a stale head only makes it look fuller
+}
+
+static bool lf_has_space(struct lf_ring *r){
+    unsigned long pos = READ_ONCE(r->tail.pos);
+    return lf_under_capacity(r, pos) && lf_seq_diff(lf_cell(r, pos), pos) >= 0;
+}
+
+static bool lf_has_items(struct lf_ring *r){
+    unsigned long pos = READ_ONCE(r->head.pos);
+    return lf_seq_diff(lf_cell(r, pos), pos + 1) >= 0;
+}
+
+static unsigned long lf_occupancy(struct lf_ring *r){
+    return READ_ONCE(r->tail.pos) - READ_ONCE(r->head.pos);
+}
+
+// false with snapshot and bench, then the slots only hold copies
+static bool slots_hold_tasks(void){
+    return !snapshot && !bench;
+}
+
+// utime + stime of the whole process: what its exited threads left in signal
+// plus every live thread, like thread_group_cputime() (which isn't exported,
+// and neither is task_cputime(), so these are the raw fields; with tick based
+// accounting they are as current as the last tick). The caller holds a
+// reference or the rcu lock, either keeps task->signal around
+static u64 task_cpu_ns(struct task_struct *task){
+    struct signal_struct *sig = task->signal;
+    struct task_struct *t;
+    u64 ns = READ_ONCE(sig->utime) + READ_ONCE(sig->stime);
+
+    rcu_read_lock();
+    for_each_thread(task, t) //no lock against exits, a thread may be in both or neither for a moment
+        ns += READ_ONCE(t->utime) + READ_ONCE(t->stime);
+    rcu_read_unlock();
+    return ns;
+}
+
+// copy what the consumer needs out of the task, NULL is a synthetic bench item
+static void slot_fill(struct pc_slot *slot, struct task_struct *task){
+    if(!task){ //pid 0, and it "started" when it was produced
+        slot->pid = 0;
+        slot->uid = uuid;
+        slot->cpu_ms = 0; //never ran
+        slot->enqueue_ns = slot->start_time = ktime_get_ns();
+        return;
+    }
+    slot->pid = task->pid;
+    slot->start_time = task->start_time;
+    if(!slots_hold_tasks()){
+        slot->uid = task_uid(task).val; //takes the rcu lock itself, the walks may have dropped theirs by now
+        if(cpuTime) //rounded to the nearest ms, saturates instead of wrapping
+            slot->cpu_ms = min_t(u64, DIV_ROUND_CLOSEST_ULL(task_cpu_ns(task), NSEC_PER_MSEC), U32_MAX);
+    } else {
+        get_task_struct(task); //keeps the task_struct around until the consumer is done with it
+        slot->task = task;
+    }
+    slot->enqueue_ns = ktime_get_ns();
+}
+
+// uid of the task in the slot
+static uid_t slot_uid(const struct pc_slot *slot){
+    if(!slots_hold_tasks())
+        return slot->uid;
+    return task_uid(slot->task).val; //we hold a reference, task_uid takes care of the rcu part
+}
+
+// CPU time of the task in the slot (cpuTime)
+static u64 slot_cpu_ns(const struct pc_slot *slot){
+    if(!slots_hold_tasks())
+        return (u64)slot->cpu_ms * NSEC_PER_MSEC;
+    return task_cpu_ns(slot->task); //the task may still be running, this is as of now
+}
+
+// consumer is finished with the slot
+static void slot_release(const struct pc_slot *slot){
+    if(slots_hold_tasks())
+        put_task_struct(slot->task);
+}
+
+// drops the references held by items nobody consumed in r
+static void lf_release(struct lf_ring *r){
+    for(unsigned long pos = r->head.pos; pos != r->tail.pos; pos++)
+        slot_release(lf_cell(r, pos));
+}
+
+// returns false if the ring is full, index gets the buffer slot used
+static bool lf_try_push(struct lf_ring *r, struct task_struct *task, int *index){
+    unsigned long pos = READ_ONCE(r->tail.pos);
+    struct pc_slot *cell;
+    s32 diff;
+
+    for(;;){
+        cell = lf_cell(r, pos);
+        diff = lf_seq_diff(cell, pos);
+        if(diff < 0 || (diff == 0 && !lf_under_capacity(r, pos))) //consumer hasn't freed this cell yet, or we'd be over buffSize
+            return false;
+        if(diff > 0){ //another producer already filled pos, reload
+            pos = READ_ONCE(r->tail.pos);
+            continue;
         }
-        for(int i = 0; i < cons; i++){ //loop over all consumer threads, we create consumer threads
-            char *name = kmalloc(20 * sizeof(char), GFP_KERNEL); //name consumer thread
-            sprintf(name, "Consumer-%d", i+1); //put Consumer-number into the name of the current consumer
-            consumerThreads[i] = kthread_run(kthread_consumer, name, "%s", name); //we run the created consumer thread(function(below),name of thread,string type,(name as argument passed into function))
-            if (IS_ERR(consumerThreads[i])) {  //if kthread run fails then we cannot create thread consumer
-                printk(KERN_INFO "ERROR: Cannot create thread Consumer\n");
-                return PTR_ERR(consumerThreads[i]);;
-            }
+        if(r->oneProducer){ //nobody to race with
+            WRITE_ONCE(r->tail.pos, pos + 1);
+            break;
         }
+        if(cmpxchg(&r->tail.pos, pos, pos + 1) == pos)
+            break;
+        pos = READ_ONCE(r->tail.pos); //lost the race, try the new tail
     }
+    slot_fill(cell, task);
+    *index = lf_buffer_index(r, pos);
+    smp_store_release(&cell->seq, (u32)(pos + 1)); //publish the item
+    return true;
+}
+
+// returns false if the ring is empty, pos gets the ring position we took
+static bool lf_try_pop(struct lf_ring *r, struct pc_slot *slot, unsigned long *pos_out){
+    unsigned long pos = READ_ONCE(r->head.pos);
+    struct pc_slot *cell;
+    s32 diff;
 
-    // 4. Create producer ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-    if(prod == 1){ //we can only have one producer
-        printk(KERN_INFO "Creating producer thread\n"); 
-        producerThread = kthread_run(kthread_producer, NULL, "Producer-1"); //run the kthread_producer, NULL(default), "Producer-1" is name
-        if (IS_ERR(producerThread)) { //if there is error
-            printk(KERN_INFO "ERROR: Cannot create thread Producer-1\n");
-            return PTR_ERR(producerThread);
+    for(;;){
+        cell = lf_cell(r, pos);
+        diff = lf_seq_diff(cell, pos + 1);
+        if(diff < 0) //producer hasn't filled this cell yet
+            return false;
+        if(diff > 0){ //another consumer already took pos, reload
+            pos = READ_ONCE(r->head.pos);
+            continue;
         }
+        if(r->oneConsumer){ //nobody to race with
+            WRITE_ONCE(r->head.pos, pos + 1);
+            break;
+        }
+        if(cmpxchg(&r->head.pos, pos, pos + 1) == pos)
+            break;
+        pos = READ_ONCE(r->head.pos); //lost the race, try the new head
     }
+    *slot = *cell; //copy the record out before the producer can reuse the cell
+    *pos_out = pos;
+    smp_store_release(&cell->seq, (u32)(pos + r->size)); //free the cell for the producer's next lap
+    return true;
+}
+
+/* Sub-rings ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    With ringMode 2 every consumer owns a lock-free ring of its own, cut out
+    of buffer[] (buffSize / cons items each, the first few get one extra), so
+    the total capacity is still buffSize. Producers deal items round-robin
+    over the rings, skipping full ones. A consumer drains its own ring and
+    only when that is empty does it steal a batch from the next ring over,
+    so in the common case consumers never touch each other's cachelines.
+
+    Because of stealing a ring's head can still be raced for when cons > 1,
+    but only by the owner and whoever is stealing at that moment, not by every
+    consumer at once. Item# in this mode counts per consumer, there is no
+    global consumption order to number by.
+*/
+static struct lf_ring *subRings = NULL;
+static int nSubRings = 0; //cons, or 1 when there are no consumers
+static DECLARE_WAIT_QUEUE_HEAD(shardNotFull); //producers sleep here when every ring is full
+
+// items sub-ring i may hold
+static unsigned long shard_capacity(int i){
+    return buffSize / nSubRings + (i < buffSize % nSubRings);
+}
 
+static int shard_init(void){
+    struct pc_slot *cells = buffer;
 
+    subRings = kcalloc(nSubRings, sizeof(struct lf_ring), GFP_KERNEL);
+    if(!subRings)
+        return -1;
+    for(int i = 0; i < nSubRings; i++){
+        lf_init(&subRings[i], cells, shard_capacity(i), prod == 1, nSubRings == 1);
+        cells += subRings[i].size;
+    }
     return 0;
 }
-//producer thread method
-static int kthread_producer(void *arg){
-    struct task_struct *task; //we create task pointer, stores the current task that our producer is looking at
-    int count = 0; //intialize the count
-    for_each_process(task){ //for each process running on the system
-        if(task->cred->uid.val == uuid){ //if the task belongs to the user (uid = who owns the task)
-            // add task to buffer
-            // wait for empty using down_interruptible to allow for module to be unloaded
-            //down_interruptiable means we can interrupt task and we can decrement
-            if (down_interruptible(&empty)) break; // we move empty down, if it cannot aquire a lock it waits. Interrupted(true) --> breaks
-            if (down_interruptible(&mutex)) break; // we move lock down, but cannot move we wait. Interrupted(true) --> breaks
-            // Critical section ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-            buffer[tail] = task; // we add things to the tail
-            // print with this format: [Producer-1] Produced Item#-12 at buffer index:1 for PID:136042
-            count++; //increment the item count for print
-            printk(KERN_INFO "[Producer-1] Produced Item#-%d at buffer index:%d for PID:%d\n", count, tail, task->pid); // we tell which item was produced where
-            tail = (tail + 1) % buffSize; //this is how we keep track of where we are in the tail
-            // end critical section ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-            up(&mutex); //increment mutex, release lock
-            up(&full); //increment full, addded task (we tell consumer there is stuff to take)
-            // signal the semaphore
-        }
+
+// slots buffer[] needs for the current ringMode
+static unsigned long buffer_cells(void){
+    unsigned long n = 0;
+
+    if(ringMode != RING_SHARDED)
+        return ring_cells(buffSize);
+    for(int i = 0; i < nSubRings; i++)
+        n += ring_cells(shard_capacity(i));
+    return n;
+}
+
+static bool shard_has_space(void){
+    for(int i = 0; i < nSubRings; i++)
+        if(lf_has_space(&subRings[i]))
+            return true;
+    return false;
+}
+
+static bool shard_has_items(void){
+    for(int i = 0; i < nSubRings; i++)
+        if(lf_has_items(&subRings[i]))
+            return true;
+    return false;
+}
+
+// drops the references held by items nobody consumed, only once every thread is stopped
+static void buffer_release(void){
+    if(ringMode == RING_LOCKFREE){
+        lf_release(&lfRing);
+        return;
+    }
+    if(ringMode == RING_SHARDED){
+        for(int i = 0; i < nSubRings; i++)
+            lf_release(&subRings[i]);
+        return;
+    }
+    for(unsigned long pos = headCount; pos != tailCount; pos++)
+        slot_release(&buffer[buffer_slot(pos)]);
+}
+
+/* Traced waits ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    Every blocking point goes through these so the pc_wait/pc_up tracepoints in
+    producer_consumer_trace.h see it. The clock is only read while tracing is on.
+*/
+static unsigned long ring_occupancy(void){
+    unsigned long n = 0;
+
+    if(ringMode == RING_LOCKFREE)
+        return lf_occupancy(&lfRing);
+    if(ringMode == RING_SHARDED){
+        for(int i = 0; i < nSubRings; i++)
+            n += lf_occupancy(&subRings[i]);
+        return n;
+    }
+    return READ_ONCE(tailCount) - READ_ONCE(headCount);
+}
+
+static int traced_down(struct semaphore *sem, int what){
+    u64 start;
+    int ret;
+
+    if(!trace_pc_wait_enabled())
+        return down_interruptible(sem);
+    start = ktime_get_ns();
+    ret = down_interruptible(sem);
+    trace_pc_wait(what, ktime_get_ns() - start, ring_occupancy(), ret);
+    return ret;
+}
+
+static void traced_up(struct semaphore *sem, int what){
+    up(sem);
+    if(trace_pc_up_enabled()) //ring_occupancy() isn't free, sums every sub-ring
+        trace_pc_up(what, ring_occupancy());
+}
+
+// wait_event_interruptible on one of the ring queues, traced the same way
+#define traced_wait_event(wq, what, condition) ({ \
+    u64 __start = trace_pc_wait_enabled() ? ktime_get_ns() : 0; \
+    int __ret = wait_event_interruptible(wq, condition); \
+    if(__start) \
+        trace_pc_wait(what, ktime_get_ns() - __start, ring_occupancy(), __ret); \
+    __ret; \
+})
+
+/* Wait strategy ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    With waitMode 1 or 2 a thread that finds the buffer empty (or full) polls
+    for a while before it sleeps. Spinners are not on the wait queue, so the
+    other side's wq_has_sleeper check skips the wakeup for them too; if the
+    spin runs out the normal sleep rechecks the condition, nothing is missed.
+
+    waitMode 2 keeps an average of how long this thread's waits have been
+    taking and spins for twice that. When waits usually take longer than
+    spinNs it stops spinning and sleeps right away. Every wait is still
+    measured, so it starts spinning again once items come faster.
+    The spin also gives up if the scheduler wants the CPU back.
+*/
+static u64 wait_budget(const struct pc_wait *w){
+    if(waitMode == WAIT_SPIN)
+        return spinNs;
+    if(w->avgNs > spinNs) //waits are long lately, spinning would just burn the CPU
+        return 0;
+    return min_t(u64, 2 * w->avgNs, spinNs);
+}
+
+static void wait_learn(struct pc_wait *w, u64 ns){
+    ns = min_t(u64, ns, 4 * (u64)spinNs); //one long sleep shouldn't turn spinning off for ages
+    w->avgNs = w->avgNs - (w->avgNs >> 3) + (ns >> 3); //1/8 weight for the newest wait
+}
+
+// evaluates condition until it is true or deadline passes, true if it came true
+#define spin_until(deadline, condition) ({ \
+    bool __done; \
+    while(!(__done = (condition)) && ktime_get_ns() < (deadline) && !need_resched()) \
+        cpu_relax(); \
+    __done; \
+})
+
+// wrapped around the sleep of either kind of wait, returns what the sleep returned
+#define strategy_wait(w, what, condition, sleep) ({ \
+    u64 __start = ktime_get_ns(); \
+    int __ret = 0; \
+    if(spin_until(__start + wait_budget(w), condition)){ \
+        WRITE_ONCE((w)->spun, (w)->spun + 1); \
+    } else { \
+        WRITE_ONCE((w)->slept, (w)->slept + 1); \
+        __ret = (sleep); \
+    } \
+    wait_learn(w, ktime_get_ns() - __start); \
+    if(trace_pc_wait_enabled()) \
+        trace_pc_wait(what, ktime_get_ns() - __start, ring_occupancy(), __ret); \
+    __ret; \
+})
+
+// down on empty/full with the wait strategy in front of the sleep
+static int wait_down(struct semaphore *sem, int what, struct pc_wait *w){
+    if(waitMode == WAIT_SLEEP)
+        return traced_down(sem, what);
+    if(!down_trylock(sem)) //nothing to wait for
+        return 0;
+    return strategy_wait(w, what, !down_trylock(sem), down_interruptible(sem));
+}
+
+// traced_wait_event with the wait strategy in front of the sleep
+#define wait_event_strategy(w, wq, what, condition) ({ \
+    int __wret; \
+    if(waitMode == WAIT_SLEEP) \
+        __wret = traced_wait_event(wq, what, condition); \
+    else \
+        __wret = strategy_wait(w, what, condition, wait_event_interruptible(wq, condition)); \
+    __wret; \
+})
+
+// the wakeups are split out so a whole batch can be published before waking anyone
+static void lf_wake_consumers(struct lf_ring *r){
+    if(wq_has_sleeper(&r->notEmpty)) //only pay for the wakeup if someone is asleep
+        wake_up_interruptible(&r->notEmpty);
+}
+
+static void lf_wake_producer(struct lf_ring *r){
+    if(wq_has_sleeper(&r->notFull))
+        wake_up_interruptible(&r->notFull);
+}
+
+static void shard_wake_producers(void){
+    if(wq_has_sleeper(&shardNotFull))
+        wake_up_interruptible(&shardNotFull);
+}
+
+// blocking push, returns nonzero if we were interrupted or told to stop
+static int lf_push(struct lf_ring *r, struct task_struct *task, int *index, struct pc_wait *w){
+    while(!lf_try_push(r, task, index)){
+        if(wait_event_strategy(w, r->notFull, PC_WAIT_NOT_FULL, lf_has_space(r) || pc_should_stop()))
+            return -1;
+        if(pc_should_stop())
+            return -1;
     }
     return 0;
 }
 
-static int kthread_consumer(void *arg){
-    char *thread_name = (char *)arg; // we get the name name of thread we are using
-    struct task_struct *task; //keep track of current task
-    char timeFormat[9]; //string to keep track of time to convert into hours, minutes, seconds
-    long taskTime; //time of task in nanoseconds (currentTime - taskTime)
-    //var to store current time
-    printk(KERN_INFO "Consumer thread created\n"); //for testing
-    while (!kthread_should_stop()) //while kernel threasd is running, consumer runs indefintely(producer stops)
-    {
-        // wait for full using down_interruptible to allow for module to be unloaded
-        if (down_interruptible(&full)) break; //break if interrupted, otherwise just wait
-        if (down_interruptible(&mutex)) break; //break if interrupted, otherwise just wait
-        // Critical section ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-        task = buffer[head]; //we take from the head
-        totalConsumed++; //increment number of processes consumed 
-        taskTime = ktime_get_ns() - task->start_time; //currentTime - startTime
-        totalProcessNanoseconds += taskTime; //we add the current taskTime to entire process time
-        // convert taskTime to HH:MM:SS format
-        sprintf(timeFormat, "%02ld:%02ld:%02ld", taskTime / 3600000000000, (taskTime / 60000000000) % 60, (taskTime / 1000000000) % 60); //formats the task time to put into hours,minutes,seconds
-        /* print out task info using this format: 
-        [<Consumer-thread-name>] Consumed Item#-<Item-Num> on buffer index: <buffer-index> PID:<PID consumed> Elapsed Time- <Elapsed time of the consumed PID in HH:MM:SS> */
-        printk(KERN_INFO "[%s] Consumed Item#-%d on buffer index:%d PID:%d Elapsed Time- %s", thread_name, totalConsumed, head, task->pid, timeFormat); // we print the output
-        head = (head + 1) % buffSize; //we move the head to the next slot in buffer
-        // end critical section ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-        up(&mutex); //we release lock
-        up(&empty); //signal empty slot
-        // signal the semaphore
+// blocking pop for consumer id, -1 if we were interrupted or told to stop,
+// 1 if cons went below id meanwhile (see Runtime resizing)
+static int lf_pop(struct lf_ring *r, struct pc_slot *slot, unsigned long *pos, struct pc_wait *w, int id){
+    while(!lf_try_pop(r, slot, pos)){
+        if(wait_event_strategy(w, r->notEmpty, PC_WAIT_NOT_EMPTY, lf_has_items(r) || pc_should_stop() || id > READ_ONCE(cons)))
+            return -1;
+        if(pc_should_stop())
+            return -1;
+        if(id > READ_ONCE(cons))
+            return 1;
     }
-    kfree(thread_name); //release thread name in memory 
     return 0;
 }
 
-// Module exit function ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-static void __exit producer_consumer_exit(void){
-    char timeFormat[9]; //for our time format
-    /* clean up tasks
-        1. stop threads
-        2. signal semaphores to wake up threads
-        3. free memory
-    */
-    
-    for(int i = 0; i < cons; i++){ //for all consumer threads, we stop them from running
-        kthread_stop(consumerThreads[i]);
+// takes up to max items from r without blocking, indexes get their buffer slots
+static int lf_pop_some(struct lf_ring *r, struct pc_slot *slots, unsigned long *indexes, int max){
+    unsigned long pos;
+    int n = 0;
+
+    while(n < max && lf_try_pop(r, &slots[n], &pos))
+        indexes[n++] = lf_buffer_index(r, pos);
+    return n;
+}
+
+
+/* Logging ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    With logMode 1 every produce/consume becomes a fixed 32 byte record in the
+    trace buffer of whatever CPU the thread is on. Preemption is off while the
+    record is written, so only that CPU ever writes its buffer and no lock is
+    needed. next is published with a release store after the record is filled,
+    so a reader only ever sees whole records. Records are never overwritten;
+    once a CPU's buffer is full it just counts what it dropped.
+
+    Reading /proc/producer_consumer_trace merges the CPUs back into timestamp
+    order and prints each record with the same format printk would have used,
+    so the test harness can keep parsing it like dmesg.
+*/
+// one place for the line formats so the trace reader prints exactly what dmesg would
+#define PRODUCED_FMT "[Producer-%d] Produced Item#-%lu at buffer index:%lu for PID:%d\n"
+#define CONSUMED_FMT "[Consumer-%d] Consumed Item#-%lu on buffer index:%lu PID:%d Elapsed Time- %s"
+
+#define TRACE_PRODUCE 0
+#define TRACE_CONSUME 1
+
+struct trace_record {
+    u64 timestamp; //ktime_get_ns() when it was logged, used to merge the CPUs
+    u64 elapsed; //elapsed time of the task in ns (consume only)
+    u32 item; //Item#
+    s32 pid;
+    u32 index; //buffer index
+    u16 thread; //the N in Producer-N or Consumer-N
+    u8 type; //TRACE_PRODUCE or TRACE_CONSUME
+    u8 pad;
+};
+
+struct trace_cpu {
+    struct trace_record *records;
+    unsigned int next; //how many records are written, only this CPU changes it
+    unsigned int dropped; //records that didn't fit
+};
+
+static struct trace_cpu __percpu *traceCpus = NULL;
+static struct proc_dir_entry *traceProc = NULL;
+
+/* Elapsed time ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    Everything that prints an elapsed time goes through format_elapsed, and
+    only right where the line is printed; the counters are always plain ns.
+    It is two 64/32 divisions (ns -> seconds -> hours) and the rest is done
+    in 32 bits, instead of three 64 bit divisions by huge constants.
+    Hours are not cut off at 99, the field just gets wider.
+*/
+#define ELAPSED_LEN 24 //enough for a u64 of ns or HH:MM:SS with any number of hours
+
+// HH:MM:SS (or the ns with rawNs), returns buf so it can go straight into a printk
+static const char *format_elapsed(char *buf, u64 ns){
+    u64 hours;
+    u32 rem;
+
+    if(rawNs){
+        snprintf(buf, ELAPSED_LEN, "%llu", ns);
+        return buf;
     }
+    hours = div_u64_rem(div_u64(ns, NSEC_PER_SEC), 3600, &rem); //rem is the seconds into the hour
+    snprintf(buf, ELAPSED_LEN, "%02llu:%02u:%02u", hours, rem / 60, rem % 60); //formats the time to put into hours,minutes,seconds
+    return buf;
+}
 
-    up(&mutex); //we release the lock
-    up(&full); //we signal to the consumer can take stuff
+static void trace_log(u8 type, int thread, unsigned long item, unsigned long index, pid_t pid, u64 elapsed){
+    struct trace_cpu *tc = get_cpu_ptr(traceCpus); //also keeps us on this CPU until put_cpu_ptr
+    unsigned int n = tc->next;
 
-    kfree(buffer); //we release the buffer in memory
-    if(cons > 0) //we release consumer threads in memory
-        kfree(consumerThreads);
+    if(n < traceSize){
+        struct trace_record *rec = &tc->records[n];
+        rec->timestamp = ktime_get_ns();
+        rec->elapsed = elapsed;
+        rec->item = item;
+        rec->pid = pid;
+        rec->index = index;
+        rec->thread = thread;
+        rec->type = type;
+        smp_store_release(&tc->next, n + 1); //record is complete, readers can see it now
+    } else {
+        tc->dropped++;
+    }
+    put_cpu_ptr(traceCpus);
+}
 
-    // print: The total elapsed time of all processes for UID <UID of the user> is <HH:MM:SS>
-    sprintf(timeFormat, "%02ld:%02ld:%02ld", totalProcessNanoseconds / 3600000000000, (totalProcessNanoseconds / 60000000000) % 60, (totalProcessNanoseconds / 1000000000) % 60);
-    printk(KERN_INFO "The total elapsed time of all processes for UID %u is %s\n", uuid, timeFormat);
+static void log_produced(int thread, unsigned long item, unsigned long index, pid_t pid){
+    if(bench && logMode == LOG_PRINTK) //we'd only be measuring printk
+        return;
+    if(logMode == LOG_TRACE){
+        trace_log(TRACE_PRODUCE, thread, item, index, pid, 0);
+        return;
+    }
+    printk(KERN_INFO PRODUCED_FMT, thread, item, index, pid); // we tell which item was produced where
+}
+
+static void log_consumed(int thread, unsigned long item, unsigned long index, pid_t pid, u64 elapsed){
+    char timeFormat[ELAPSED_LEN]; //string to keep track of time to convert into hours, minutes, seconds
+
+    if(bench && logMode == LOG_PRINTK)
+        return;
+    if(logMode == LOG_TRACE){ //formatting waits until someone reads the trace
+        trace_log(TRACE_CONSUME, thread, item, index, pid, elapsed);
+        return;
+    }
+    format_elapsed(timeFormat, elapsed); // convert taskTime to HH:MM:SS format
+    /* print out task info using this format: 
+    [<Consumer-thread-name>] Consumed Item#-<Item-Num> on buffer index: <buffer-index> PID:<PID consumed> Elapsed Time- <Elapsed time of the consumed PID in HH:MM:SS> */
+    printk(KERN_INFO CONSUMED_FMT, thread, item, index, pid, timeFormat); // we print the output
+}
+
+static int trace_init(void){
+    int cpu;
+
+    traceCpus = alloc_percpu(struct trace_cpu); //zeroed
+    if(!traceCpus)
+        return -1;
+    for_each_possible_cpu(cpu){ //keep each CPU's records on its own node
+        struct trace_cpu *tc = per_cpu_ptr(traceCpus, cpu);
+        tc->records = kvmalloc_node(traceSize * sizeof(struct trace_record), GFP_KERNEL, cpu_to_node(cpu));
+        if(!tc->records)
+            return -1;
+    }
+    return 0;
+}
+
+static void trace_free(void){
+    unsigned long dropped = 0;
+    int cpu;
+
+    if(!traceCpus)
+        return;
+    for_each_possible_cpu(cpu){
+        struct trace_cpu *tc = per_cpu_ptr(traceCpus, cpu);
+        dropped += tc->dropped;
+        kvfree(tc->records);
+    }
+    free_percpu(traceCpus);
+    traceCpus = NULL;
+    if(dropped)
+        printk(KERN_WARNING "producer_consumer trace buffer dropped %lu records, raise traceSize\n", dropped);
+}
+
+/* Trace reader ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    A seq_file that does a k-way merge over the CPU buffers. The cursors live in
+    the per-open private data; seq_file normally asks for the position we
+    stopped at, and only if it asks for a different one do we replay the merge
+    from the start.
+*/
+struct trace_iter {
+    loff_t pos; //merged position the cursors are at
+    int cpu; //CPU whose record trace_peek returned
+    unsigned int cursor[]; //next unread record on each CPU
+};
+
+static struct trace_record *trace_peek(struct trace_iter *it){
+    struct trace_record *best = NULL;
+    int cpu;
+
+    for_each_possible_cpu(cpu){
+        struct trace_cpu *tc = per_cpu_ptr(traceCpus, cpu);
+        unsigned int n = smp_load_acquire(&tc->next);
+        struct trace_record *rec;
+
+        if(it->cursor[cpu] >= n)
+            continue;
+        rec = &tc->records[it->cursor[cpu]];
+        if(!best || rec->timestamp < best->timestamp){
+            best = rec;
+            it->cpu = cpu;
+        }
+    }
+    return best;
+}
+
+static void *trace_seq_start(struct seq_file *m, loff_t *pos){
+    struct trace_iter *it = m->private;
+
+    if(*pos != it->pos){ //someone seeked, replay from the beginning
+        memset(it->cursor, 0, nr_cpu_ids * sizeof(unsigned int));
+        for(it->pos = 0; it->pos < *pos && trace_peek(it); it->pos++)
+            it->cursor[it->cpu]++;
+    }
+    return trace_peek(it);
+}
+
+static void *trace_seq_next(struct seq_file *m, void *v, loff_t *pos){
+    struct trace_iter *it = m->private;
+
+    it->cursor[it->cpu]++; //v came from it->cpu
+    it->pos++;
+    ++*pos;
+    return trace_peek(it);
+}
+
+static void trace_seq_stop(struct seq_file *m, void *v){
+}
+
+static int trace_seq_show(struct seq_file *m, void *v){
+    struct trace_record *rec = v;
+    char timeFormat[ELAPSED_LEN];
+
+    if(rec->type == TRACE_PRODUCE){
+        seq_printf(m, PRODUCED_FMT, rec->thread, (unsigned long)rec->item, (unsigned long)rec->index, rec->pid);
+    } else {
+        format_elapsed(timeFormat, rec->elapsed);
+        seq_printf(m, CONSUMED_FMT "\n", rec->thread, (unsigned long)rec->item, (unsigned long)rec->index, rec->pid, timeFormat);
+    }
+    return 0;
+}
+
+static const struct seq_operations trace_seq_ops = {
+    .start = trace_seq_start,
+    .next = trace_seq_next,
+    .stop = trace_seq_stop,
+    .show = trace_seq_show,
+};
+
+static int trace_proc_open(struct inode *inode, struct file *file){
+    return seq_open_private(file, &trace_seq_ops, sizeof(struct trace_iter) + nr_cpu_ids * sizeof(unsigned int)); //0 on success
+}
+
+static const struct proc_ops trace_proc_ops = {
+    .proc_open = trace_proc_open,
+    .proc_read = seq_read,
+    .proc_lseek = seq_lseek,
+    .proc_release = seq_release_private,
+};
+
+
+/* Per-UID reports ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    Both the exit summary and /proc fold the consumer tables into one and
+    sort it by uid. With a uids list every listed uid is reported, even at 0.
+*/
+struct uid_report {
+    struct uid_total *merged; //UID_TABLE_SIZE entries
+    struct uid_total *sorted; //the used entries of merged plus unseen listed uids, by uid
+    int n;
+    u64 otherConsumed, otherNanoseconds, otherCpuNanoseconds;
+};
+
+static int uid_total_cmp(const void *a, const void *b){
+    return uid_cmp(&((const struct uid_total *)a)->uid, &((const struct uid_total *)b)->uid);
+}
+
+static int uid_report_build(struct uid_report *r){
+    memset(r, 0, sizeof(*r));
+    r->merged = kcalloc(UID_TABLE_SIZE, sizeof(struct uid_total), GFP_KERNEL);
+    r->sorted = kmalloc_array(UID_TABLE_SIZE + MAX_UIDS, sizeof(struct uid_total), GFP_KERNEL);
+    if(!r->merged || !r->sorted){
+        kfree(r->merged);
+        kfree(r->sorted);
+        return -ENOMEM;
+    }
+    for(int i = 0; i < consSeen; i++){
+        struct uid_total *table = consumerStats[i].uidTotals;
+        for(int j = 0; j < UID_TABLE_SIZE; j++){
+            u64 n = smp_load_acquire(&table[j].consumed);
+            u64 ns, cpuNs;
+            if(!n)
+                continue;
+            ns = READ_ONCE(table[j].nanoseconds);
+            cpuNs = READ_ONCE(table[j].cpuNs);
+            if(!uid_add(r->merged, table[j].uid, n, ns, cpuNs)){
+                r->otherConsumed += n;
+                r->otherNanoseconds += ns;
+                r->otherCpuNanoseconds += cpuNs;
+            }
+        }
+        r->otherConsumed += READ_ONCE(consumerStats[i].otherConsumed);
+        r->otherNanoseconds += READ_ONCE(consumerStats[i].otherNanoseconds);
+        r->otherCpuNanoseconds += READ_ONCE(consumerStats[i].otherCpuNanoseconds);
+    }
+    for(int j = 0; j < UID_TABLE_SIZE; j++){
+        if(r->merged[j].consumed)
+            r->sorted[r->n++] = r->merged[j];
+    }
+    for(int i = 0; i < nrUids; i++){ //listed uids show up even if nothing was consumed
+        struct uid_total *t = uid_lookup(r->merged, uids[i]);
+        if(t && !t->consumed)
+            r->sorted[r->n++] = (struct uid_total){ .uid = uids[i] };
+    }
+    sort(r->sorted, r->n, sizeof(struct uid_total), uid_total_cmp, NULL);
+    return 0;
+}
+
+static void uid_report_free(struct uid_report *r){
+    kfree(r->merged);
+    kfree(r->sorted);
+}
+
+/* Top-K ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    Every consumer keeps the topK longest running processes it consumed in
+    a min-heap of fixed size, so the shortest of them is at the root. A
+    process that isn't longer than the root (most of them once the heap is
+    full) costs one compare, the others replace the root and sift it down,
+    O(log K) and no allocation.
+
+    The owning consumer is the only writer. It bumps topSeq around every
+    change so /proc can copy the heap and retry if it changed under it.
+    The reports merge the consumer heaps into one the same way and sort it,
+    longest first.
+*/
+struct top_task {
+    u64 ns; //elapsed time when it was consumed
+    pid_t pid;
+    uid_t uid;
+};
+
+static void top_sift_up(struct top_task *h, int i){
+    while(i > 0){
+        int parent = (i - 1) / 2;
+        if(h[parent].ns <= h[i].ns)
+            break;
+        swap(h[parent], h[i]);
+        i = parent;
+    }
+}
+
+static void top_sift_down(struct top_task *h, int n, int i){
+    for(;;){
+        int smallest = i, l = 2 * i + 1, r = l + 1;
+        if(l < n && h[l].ns < h[smallest].ns)
+            smallest = l;
+        if(r < n && h[r].ns < h[smallest].ns)
+            smallest = r;
+        if(smallest == i)
+            break;
+        swap(h[smallest], h[i]);
+        i = smallest;
+    }
+}
+
+// puts t in the min-heap h of *n entries if it is one of the k longest
+static void top_push(struct top_task *h, int *n, int k, const struct top_task *t){
+    if(*n < k){
+        h[*n] = *t;
+        top_sift_up(h, (*n)++);
+    } else if(t->ns > h[0].ns){ //replaces the shortest one
+        h[0] = *t;
+        top_sift_down(h, k, 0);
+    }
+}
+
+// consumer side, only the owner calls it
+static void top_add(struct consumer_stats *stats, pid_t pid, uid_t uid, u64 ns){
+    struct top_task t = { .ns = ns, .pid = pid, .uid = uid };
+
+    if(stats->nTop == topK && ns <= stats->top[0].ns) //not one of them, the common case
+        return;
+    preempt_disable(); //a reader would spin for as long as we are preempted in here
+    write_seqcount_begin(&stats->topSeq);
+    top_push(stats->top, &stats->nTop, topK, &t);
+    write_seqcount_end(&stats->topSeq);
+    preempt_enable();
+}
+
+static int top_cmp(const void *a, const void *b){
+    u64 x = ((const struct top_task *)a)->ns, y = ((const struct top_task *)b)->ns;
+    return x < y ? 1 : -(x > y); //longest first
+}
+
+// fills out (topK entries) with the longest running processes of all consumers, longest first.
+// returns how many there are, or -ENOMEM
+static int top_merge(struct top_task *out){
+    struct top_task *copy = kmalloc_array(topK, sizeof(struct top_task), GFP_KERNEL);
+    int n = 0;
+
+    if(!copy)
+        return -ENOMEM;
+    for(int i = 0; i < consSeen; i++){
+        struct consumer_stats *c = &consumerStats[i];
+        unsigned int seq;
+        int m;
+        do {
+            seq = read_seqcount_begin(&c->topSeq);
+            m = min(READ_ONCE(c->nTop), topK); //never more than the copy holds, even torn
+            memcpy(copy, c->top, m * sizeof(struct top_task));
+        } while(read_seqcount_retry(&c->topSeq, seq));
+        for(int j = 0; j < m; j++)
+            top_push(out, &n, topK, &copy[j]);
+    }
+    kfree(copy);
+    sort(out, n, sizeof(struct top_task), top_cmp, NULL);
+    return n;
+}
+
+/* Export ring ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    With exportSize every consumer also writes one binary record per item
+    (pid, uid, elapsed, CPU time, consumer) into its own ring in a vmalloc
+    area that userspace mmaps from /proc/producer_consumer_export, so a
+    collector reads them in place with no printk and no copying. The layout
+    and the head/tail protocol are in producer_consumer_export.h,
+    export_read/export_read.c is a reader.
+
+    One ring per consumer keeps every ring single writer, so writing a record
+    is a store and the head is published once per batch. The module never
+    waits for the reader: a record that doesn't fit is counted in lost.
+    poll() says readable when any ring has unread records and consumers
+    wake it once per batch, and only if someone is waiting.
+
+    The reader writes tail, so the module only trusts it as far as the
+    index mask goes. A bad tail loses or overwrites records, nothing else.
+*/
+static void *exportArea = NULL;
+static unsigned long exportMask = 0; //records per ring - 1
+static DECLARE_WAIT_QUEUE_HEAD(exportWait);
+static struct proc_dir_entry *exportProc = NULL;
+
+// -1 on error. After contexts_init, every consumer context gets a ring
+static int export_init(void){
+    unsigned long records;
+    size_t stride;
+    struct pc_export_info *info;
+
+    if(!exportSize)
+        return 0;
+    records = roundup_pow_of_two(exportSize); //init checked it is at most EXPORT_MAX
+    stride = PAGE_SIZE + PAGE_ALIGN(array_size(records, sizeof(struct pc_export_record)));
+    exportArea = vmalloc_user(size_add(PAGE_SIZE, array_size(consMax, stride))); //zeroed, and allowed to be mapped. SIZE_MAX on overflow, which just fails
+    if(!exportArea)
+        return -1;
+    exportMask = records - 1;
+    info = exportArea;
+    info->rings = consMax;
+    info->records = records;
+    info->recordSize = sizeof(struct pc_export_record);
+    info->ringOffset = PAGE_SIZE;
+    info->ringStride = stride;
+    info->recordOffset = PAGE_SIZE;
+    for(int i = 0; i < consMax; i++){
+        char *ring = (char *)exportArea + PAGE_SIZE + i * stride;
+        consumerStats[i].exportHeader = (struct pc_export_ring_header *)ring;
+        consumerStats[i].exportRecords = (struct pc_export_record *)(ring + PAGE_SIZE);
+    }
+    smp_wmb(); //the rest of the info before the magic that says it is valid
+    info->magic = PC_EXPORT_MAGIC;
+    return 0;
+}
+
+static void export_free(void){
+    vfree(exportArea); //pages still mapped stay around until they are unmapped
+}
+
+// consumer side, after the handler saw the batch
+static void export_batch(struct consumer_stats *stats, const struct pc_slot *slots, int n, u64 now){
+    struct pc_export_ring_header *h = stats->exportHeader;
+    u64 head = stats->exportHead, lost = stats->exportLost;
+    u64 tail = smp_load_acquire(&h->tail); //the reader is done with everything below it
+
+    for(int i = 0; i < n; i++){
+        struct pc_export_record *rec;
+        if(head - tail > exportMask){ //full
+            lost++;
+            continue;
+        }
+        rec = &stats->exportRecords[head & exportMask];
+        rec->elapsed_ns = now - slots[i].start_time;
+        rec->cpu_ns = cpuTime ? slot_cpu_ns(&slots[i]) : 0;
+        rec->pid = slots[i].pid;
+        rec->uid = slot_uid(&slots[i]);
+        rec->consumer = stats->id;
+        rec->reserved = 0;
+        head++;
+    }
+    smp_store_release(&h->head, head); //records first, then the head that covers them
+    stats->exportHead = head;
+    if(lost != stats->exportLost){
+        stats->exportLost = lost;
+        WRITE_ONCE(h->lost, lost);
+    }
+    if(wq_has_sleeper(&exportWait))
+        wake_up_interruptible(&exportWait);
+}
+
+static int export_mmap(struct file *file, struct vm_area_struct *vma){
+    if(!(vma->vm_flags & VM_SHARED)) //the reader's tail has to reach us
+        return -EINVAL;
+    return remap_vmalloc_range(vma, exportArea, vma->vm_pgoff); //checks the range fits
+}
+
+static __poll_t export_poll(struct file *file, poll_table *wait){
+    poll_wait(file, &exportWait, wait);
+    for(int i = 0; i < consSeen; i++){
+        struct pc_export_ring_header *h = consumerStats[i].exportHeader;
+        if(READ_ONCE(h->head) != READ_ONCE(h->tail))
+            return EPOLLIN | EPOLLRDNORM;
+    }
+    return READ_ONCE(stopping) ? EPOLLHUP : 0;
+}
+
+static const struct proc_ops export_proc_ops = {
+    .proc_mmap = export_mmap,
+    .proc_poll = export_poll,
+    .proc_lseek = noop_llseek,
+};
+
+/* Consumer handlers ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    The consumer loop only moves items out of the ring, what happens to them
+    is up to the handler picked with the handler parameter. It gets the whole
+    batch at once as the contiguous slots[] the consumer copied out, so a
+    handler pays for one call per batch and not one per item.
+
+        init: checks the parameters it needs at load, nonzero refuses to load
+        consume_batch: n items, outside any lock. The slot references are
+            dropped and consumed is counted after it returns
+        report: its part of /proc/producer_consumer, or with m NULL the
+            summary printed at exit (threads are stopped by then)
+
+    The queue latency histogram is kept by the consumer loop for every handler.
+*/
+struct consumer_ops {
+    const char *name;
+    int (*init)(void);
+    void (*consume_batch)(struct consumer_stats *stats, const struct pc_slot *slots, const unsigned long *positions, int n);
+    void (*report)(struct seq_file *m);
+};
+
+static const struct consumer_ops *consumerOps; //set from handler at load
+
+static void hist_show(struct seq_file *m, const char *title, const u64 *hist);
+
+// Item# of the i-th item of a batch, position in consumption order (per consumer with ringMode 2)
+static unsigned long batch_item(const struct consumer_stats *stats, const unsigned long *positions, int i){
+    if(ringMode == RING_SHARDED) //positions are buffer indexes there
+        return stats->consumed + i + 1;
+    return positions[i] + 1;
+}
+
+// buffer slot the i-th item came from
+static unsigned long batch_index(const unsigned long *positions, int i){
+    if(ringMode == RING_SHARDED)
+        return positions[i];
+    return buffer_slot(positions[i]);
+}
+
+// Elapsed handler
+// what the module always did: elapsed time (and CPU time) per consumer and per uid, printk per item
+static void consume_task(struct consumer_stats *stats, const struct pc_slot *slot, unsigned long item, unsigned long index, u64 now){
+    u64 taskTime; //time of task in nanoseconds (currentTime - taskTime)
+    u64 cpuNs = cpuTime ? slot_cpu_ns(slot) : 0;
+
+    taskTime = now - slot->start_time; //currentTime - startTime
+    WRITE_ONCE(stats->nanoseconds, stats->nanoseconds + taskTime); //we add the current taskTime to this consumer's total
+    if(cpuTime)
+        WRITE_ONCE(stats->cpuNanoseconds, stats->cpuNanoseconds + cpuNs);
+    hist_add(stats->elapsedHist, taskTime);
+    if(topK)
+        top_add(stats, slot->pid, slot_uid(slot), taskTime);
+    if(multi_uid() && !uid_add(stats->uidTotals, slot_uid(slot), 1, taskTime, cpuNs)){
+        WRITE_ONCE(stats->otherConsumed, stats->otherConsumed + 1);
+        WRITE_ONCE(stats->otherNanoseconds, stats->otherNanoseconds + taskTime);
+        WRITE_ONCE(stats->otherCpuNanoseconds, stats->otherCpuNanoseconds + cpuNs);
+    }
+    log_consumed(stats->id, item, index, slot->pid, taskTime);
+}
+
+static void elapsed_consume_batch(struct consumer_stats *stats, const struct pc_slot *slots, const unsigned long *positions, int n){
+    for(int i = 0; i < n; i++) //timing, formatting and printing all happen without the lock
+        consume_task(stats, &slots[i], batch_item(stats, positions, i), batch_index(positions, i), ktime_get_ns());
+}
+
+static void elapsed_show(struct seq_file *m){
+    u64 elapsedHist[HIST_BUCKETS] = {0};
+    u64 cpuNs = 0;
+
+    for(int i = 0; i < consSeen; i++){
+        cpuNs += READ_ONCE(consumerStats[i].cpuNanoseconds);
+        for(int b = 0; b < HIST_BUCKETS; b++)
+            elapsedHist[b] += READ_ONCE(consumerStats[i].elapsedHist[b]);
+    }
+    if(cpuTime)
+        seq_printf(m, "cpu_ns: %llu\n", cpuNs);
+    hist_show(m, "task elapsed time", elapsedHist);
+    if(topK){
+        struct top_task *top = kmalloc_array(topK, sizeof(struct top_task), GFP_KERNEL);
+        int n = top ? top_merge(top) : -ENOMEM;
+        if(n >= 0){
+            seq_printf(m, "longest running (top %d):\n", topK);
+            for(int i = 0; i < n; i++)
+                seq_printf(m, "  pid %d uid %u elapsed_ns: %llu\n", top[i].pid, top[i].uid, top[i].ns);
+        }
+        kfree(top);
+    }
+    if(multi_uid()){
+        struct uid_report r;
+        if(!uid_report_build(&r)){
+            for(int i = 0; i < r.n; i++){
+                seq_printf(m, "uid %u consumed: %llu elapsed_ns: %llu", r.sorted[i].uid, r.sorted[i].consumed, r.sorted[i].nanoseconds);
+                if(cpuTime)
+                    seq_printf(m, " cpu_ns: %llu", r.sorted[i].cpuNs);
+                seq_putc(m, '\n');
+            }
+            if(r.otherConsumed){
+                seq_printf(m, "other uids consumed: %llu elapsed_ns: %llu", r.otherConsumed, r.otherNanoseconds);
+                if(cpuTime)
+                    seq_printf(m, " cpu_ns: %llu", r.otherCpuNanoseconds);
+                seq_putc(m, '\n');
+            }
+            uid_report_free(&r);
+        }
+    }
+}
+
+// the exit summary, the last line is the one test.sh looks for
+static void elapsed_summary(void){
+    char timeFormat[ELAPSED_LEN]; //for our time format
+    u64 totalNs = 0;
+    u64 totalCpuNs = 0;
+
+    if(topK){
+        struct top_task *top = kmalloc_array(topK, sizeof(struct top_task), GFP_KERNEL);
+        int n = top ? top_merge(top) : -ENOMEM;
+        for(int i = 0; i < n; i++){
+            format_elapsed(timeFormat, top[i].ns);
+            printk(KERN_INFO "Longest running #%d: PID %d UID %u elapsed time %s\n", i+1, top[i].pid, top[i].uid, timeFormat);
+        }
+        kfree(top);
+    }
+    if(multi_uid()){ //one line per uid, same format as the single uid line
+        struct uid_report r;
+        if(!uid_report_build(&r)){
+            for(int i = 0; i < r.n; i++){
+                format_elapsed(timeFormat, r.sorted[i].nanoseconds);
+                printk(KERN_INFO "The total elapsed time of all processes for UID %u is %s\n", r.sorted[i].uid, timeFormat);
+                if(cpuTime){
+                    format_elapsed(timeFormat, r.sorted[i].cpuNs);
+                    printk(KERN_INFO "The total CPU time of all processes for UID %u is %s\n", r.sorted[i].uid, timeFormat);
+                }
+            }
+            if(r.otherConsumed){
+                format_elapsed(timeFormat, r.otherNanoseconds);
+                printk(KERN_INFO "The total elapsed time of all processes for other UIDs is %s\n", timeFormat);
+                if(cpuTime){
+                    format_elapsed(timeFormat, r.otherCpuNanoseconds);
+                    printk(KERN_INFO "The total CPU time of all processes for other UIDs is %s\n", timeFormat);
+                }
+            }
+            uid_report_free(&r);
+        }
+    }
+    for(int i = 0; i < consSeen; i++)
+        totalNs += consumerStats[i].nanoseconds;
+    for(int i = 0; i < consSeen; i++)
+        totalCpuNs += consumerStats[i].cpuNanoseconds;
+
+    // print: The total elapsed time of all processes for UID <UID of the user> is <HH:MM:SS>
+    format_elapsed(timeFormat, totalNs);
+    if(multi_uid())
+        printk(KERN_INFO "The total elapsed time of all processes for all accounted UIDs is %s\n", timeFormat);
+    else
+        printk(KERN_INFO "The total elapsed time of all processes for UID %u is %s\n", uuid, timeFormat);
+    if(cpuTime){ //same form as the elapsed line, right after it
+        format_elapsed(timeFormat, totalCpuNs);
+        if(multi_uid())
+            printk(KERN_INFO "The total CPU time of all processes for all accounted UIDs is %s\n", timeFormat);
+        else
+            printk(KERN_INFO "The total CPU time of all processes for UID %u is %s\n", uuid, timeFormat);
+    }
+}
+
+static void elapsed_report(struct seq_file *m){
+    if(m)
+        elapsed_show(m);
+    else
+        elapsed_summary();
+}
+
+static const struct consumer_ops elapsedOps = {
+    .name = "elapsed",
+    .consume_batch = elapsed_consume_batch,
+    .report = elapsed_report,
+};
+
+// RSS handler
+// resident memory of every consumed process, read from its mm when it is consumed.
+// kernel threads have no mm and count as 0. Items are logged like elapsed does,
+// the per uid, top-K and CPU time accounting is the elapsed handler's
+static int rss_init(void){
+    if(!slots_hold_tasks()){
+        printk(KERN_ERR "handler=rss needs the task itself, it can't be used with snapshot or bench\n");
+        return -1;
+    }
+    if(topK || multi_uid() || cpuTime){
+        printk(KERN_ERR "handler=rss can't be used with topK, uids, allUids or cpuTime, only handler=elapsed keeps those\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void rss_consume_batch(struct consumer_stats *stats, const struct pc_slot *slots, const unsigned long *positions, int n){
+    u64 pages = 0, largest = stats->rssMax;
+
+    for(int i = 0; i < n; i++){
+        struct mm_struct *mm = get_task_mm(slots[i].task); //NULL once the task has exited
+        u64 rss;
+        log_consumed(stats->id, batch_item(stats, positions, i), batch_index(positions, i), slots[i].pid, ktime_get_ns() - slots[i].start_time);
+        if(!mm)
+            continue;
+        rss = get_mm_rss(mm);
+        mmput(mm);
+        pages += rss;
+        largest = max(largest, rss);
+    }
+    WRITE_ONCE(stats->rssPages, stats->rssPages + pages); //one write for the batch
+    WRITE_ONCE(stats->rssMax, largest);
+}
+
+static void rss_report(struct seq_file *m){
+    u64 pages = 0, largest = 0;
+
+    for(int i = 0; i < consSeen; i++){
+        pages += READ_ONCE(consumerStats[i].rssPages);
+        largest = max(largest, READ_ONCE(consumerStats[i].rssMax));
+    }
+    if(m)
+        seq_printf(m, "rss_kb: %llu max_kb: %llu\n", pages << (PAGE_SHIFT - 10), largest << (PAGE_SHIFT - 10));
+    else
+        printk(KERN_INFO "The total RSS of all consumed processes is %llu kB, the largest is %llu kB\n",
+            pages << (PAGE_SHIFT - 10), largest << (PAGE_SHIFT - 10));
+}
+
+static const struct consumer_ops rssOps = {
+    .name = "rss",
+    .init = rss_init,
+    .consume_batch = rss_consume_batch,
+    .report = rss_report,
+};
+
+static const struct consumer_ops *const consumerHandlers[] = { &elapsedOps, &rssOps };
+
+// the ops called name, NULL if there isn't one
+static const struct consumer_ops *handler_find(const char *name){
+    for(int i = 0; i < ARRAY_SIZE(consumerHandlers); i++){
+        if(sysfs_streq(name, consumerHandlers[i]->name))
+            return consumerHandlers[i];
+    }
+    return NULL;
+}
+
+// consumer loop side of a batch: latency, the handler, then the bookkeeping
+static void consume_batch(struct consumer_stats *stats, const struct pc_slot *slots, const unsigned long *positions, int n){
+    u64 now = ktime_get_ns(); //they all came out of the ring just now
+
+    for(int i = 0; i < n; i++)
+        lat_add(stats->latencyHist, now - slots[i].enqueue_ns); //how long it sat in the buffer
+    consumerOps->consume_batch(stats, slots, positions, n);
+    if(exportArea)
+        export_batch(stats, slots, n, now);
+    for(int i = 0; i < n; i++)
+        slot_release(&slots[i]);
+    WRITE_ONCE(stats->consumed, stats->consumed + n); //increment number of processes consumed
+}
+
+/* Stats endpoint ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    /proc/producer_consumer can be read any time while the module is loaded.
+    It only reads the per-thread counters, so it never slows the threads down.
+*/
+static struct proc_dir_entry *statsProc = NULL;
+
+static void hist_show(struct seq_file *m, const char *title, const u64 *hist){
+    seq_printf(m, "%s (log2 ns buckets):\n", title);
+    for(int b = 0; b < HIST_BUCKETS; b++){
+        if(!hist[b])
+            continue;
+        if(b == 0)
+            seq_printf(m, "  [0, 1) %llu\n", hist[b]);
+        else
+            seq_printf(m, "  [2^%d, 2^%d) %llu\n", b - 1, b, hist[b]);
+    }
+}
+
+static void lat_show(struct seq_file *m){
+    u64 log2Hist[HIST_BUCKETS] = {0};
+    u64 *hist, total;
+
+    hist = kmalloc_array(LAT_BUCKETS, sizeof(u64), GFP_KERNEL); //too big for the stack
+    if(!hist)
+        return;
+    total = lat_merge(hist);
+    seq_printf(m, "queue latency p50: %llu ns p99: %llu ns p999: %llu ns\n",
+        lat_percentile(hist, total, 500), lat_percentile(hist, total, 990), lat_percentile(hist, total, 999));
+    for(int b = 0; b < LAT_BUCKETS; b++) //fold back into log2 buckets to print
+        log2Hist[min(fls64(lat_bucket_low(b)), HIST_BUCKETS - 1)] += hist[b];
+    hist_show(m, "queue latency", log2Hist);
+    kfree(hist);
+}
+
+static int stats_show(struct seq_file *m, void *v){
+    u64 produced = 0, consumed = 0, uptime;
+    u64 prodSpun = 0, prodSlept = 0, consSpun = 0, consSlept = 0;
+
+    seq_printf(m, "buffSize: %d prod: %d cons: %d ringMode: %d batch: %d pow2Ring: %d handler: %s\n", buffSize, prod, cons, ringMode, batch, pow2Ring, consumerOps->name);
+    seq_printf(m, "occupancy: %lu\n", ring_occupancy());
+    for(int i = 0; i < prod; i++){
+        u64 n = READ_ONCE(producerStats[i].produced);
+        seq_printf(m, "Producer-%d produced: %llu\n", i+1, n);
+        produced += n;
+        prodSpun += READ_ONCE(producerStats[i].wait.spun);
+        prodSlept += READ_ONCE(producerStats[i].wait.slept);
+    }
+    for(int i = 0; i < consSeen; i++){
+        u64 n = READ_ONCE(consumerStats[i].consumed);
+        if(ringMode == RING_SHARDED)
+            seq_printf(m, "%s consumed: %llu stolen: %llu\n", consumerStats[i].name, n, READ_ONCE(consumerStats[i].stolen));
+        else
+            seq_printf(m, "%s consumed: %llu\n", consumerStats[i].name, n);
+        consumed += n;
+        consSpun += READ_ONCE(consumerStats[i].wait.spun);
+        consSlept += READ_ONCE(consumerStats[i].wait.slept);
+    }
+    uptime = ktime_get_ns() - startNs;
+    seq_printf(m, "produced: %llu consumed: %llu\n", produced, consumed);
+    if(waitMode != WAIT_SLEEP){
+        seq_printf(m, "producer waits spun: %llu slept: %llu\n", prodSpun, prodSlept);
+        seq_printf(m, "consumer waits spun: %llu slept: %llu\n", consSpun, consSlept);
+    }
+    seq_printf(m, "uptime_ns: %llu\n", uptime);
+    seq_printf(m, "throughput: %llu items/sec\n", uptime ? div64_u64(consumed * NSEC_PER_SEC, uptime) : 0);
+    lat_show(m);
+    consumerOps->report(m);
+    return 0;
+}
+
+
+/* Completion ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    A one-shot producer (scanInterval 0) adds its final count to
+    producedTotal when it returns. Once every producer has done that and the
+    consumers have taken that many items, the run is done (with no consumers
+    it is done as soon as the producers are, nothing else is going to happen).
+    With scanInterval the producers never finish, so it never is.
+
+    Reading /proc/producer_consumer_done blocks until then (unless it was
+    opened O_NONBLOCK) and poll() reports it as readable, so a script can
+    just cat it instead of sleeping and then rmmod right away.
+
+    Nothing is shared per item: a consumer only looks at producersDone after
+    each batch, and only sums up everyone's consumed counts once all the
+    producers are finished. The full barriers on both sides make sure that
+    whichever of the last producer and the last consumer comes second sees
+    the other one.
+*/
+static atomic_t producersDone = ATOMIC_INIT(0); //one-shot producers that returned
+static atomic64_t producedTotal = ATOMIC64_INIT(0); //what they produced between them
+static atomic_t runDone = ATOMIC_INIT(0); //1 once everything produced is consumed
+static DECLARE_WAIT_QUEUE_HEAD(doneWait); //readers and pollers of /proc/producer_consumer_done
+static struct proc_dir_entry *doneProc = NULL;
+
+static u64 benchStartNs; //right before the producers started
+
+/* Bench report ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    Printed once when a bench run is done. The context switches are the
+    producers' and consumers' own (nvcsw voluntary, which is mostly sleeping
+    on the buffer, nivcsw involuntary). We hold a reference on every thread,
+    so a producer that already returned can still be read.
+*/
+static void bench_report(void){
+    u64 wall = ktime_get_ns() - benchStartNs;
+    unsigned long voluntary = 0, involuntary = 0;
+
+    for(int i = 0; i < prod; i++){
+        struct task_struct *t = READ_ONCE(producerThreads[i]); //set before the thread runs, see start_thread
+        if(!t)
+            continue;
+        voluntary += READ_ONCE(t->nvcsw);
+        involuntary += READ_ONCE(t->nivcsw);
+    }
+    for(int i = 0; consumerThreads && i < consSeen; i++){
+        struct task_struct *t = READ_ONCE(consumerThreads[i]); //NULL if it failed to start or is being replaced
+        if(!t)
+            continue;
+        voluntary += READ_ONCE(t->nvcsw);
+        involuntary += READ_ONCE(t->nivcsw);
+    }
+    printk(KERN_INFO "bench: buffSize: %d prod: %d cons: %d ringMode: %d batch: %d waitMode: %d\n", buffSize, prod, cons, ringMode, batch, waitMode);
+    printk(KERN_INFO "bench: %d items in %llu ns, %llu items/sec, %llu ns/item\n", bench, wall,
+        wall ? div64_u64((u64)bench * NSEC_PER_SEC, wall) : 0, bench ? div_u64(wall, bench) : 0);
+    printk(KERN_INFO "bench: context switches voluntary: %lu involuntary: %lu\n", voluntary, involuntary);
+    for(int i = 0; i < consSeen; i++){ //how evenly the items were spread
+        u64 n = READ_ONCE(consumerStats[i].consumed);
+        printk(KERN_INFO "bench: %s consumed: %llu (%llu permille)\n", consumerStats[i].name, n, bench ? div_u64(n * 1000, bench) : 0);
+    }
+}
+
+static u64 consumed_sum(void){
+    u64 n = 0;
+
+    for(int i = 0; i < consSeen; i++)
+        n += READ_ONCE(consumerStats[i].consumed);
+    return n;
+}
+
+static void done_check(void){
+    if(atomic_read(&producersDone) < prod)
+        return;
+    if(cons > 0 && consumed_sum() < atomic64_read(&producedTotal))
+        return;
+    if(atomic_xchg(&runDone, 1)) //somebody else got here first
+        return;
+    if(bench)
+        bench_report();
+    wake_up_all(&doneWait);
+}
+
+// a producer is finished for good, shard's produced count is final
+static void producer_finished(int shard){
+    atomic64_add(producerStats[shard].produced, &producedTotal);
+    atomic_inc_return(&producersDone); //full barrier, the total is in before we count as done
+    done_check();
+}
+
+// consumers call it after every batch
+static void consumer_batch_done(void){
+    smp_mb(); //our consumed count before we read producersDone, pairs with producer_finished
+    if(atomic_read(&producersDone) == prod)
+        done_check();
+}
+
+static ssize_t done_read(struct file *file, char __user *buf, size_t len, loff_t *ppos){
+    char line[64];
+    int n;
+
+    if(*ppos == 0 && !(file->f_flags & O_NONBLOCK)){
+        if(wait_event_interruptible(doneWait, atomic_read(&runDone) || READ_ONCE(stopping)))
+            return -ERESTARTSYS;
+    }
+    if(atomic_read(&runDone))
+        n = scnprintf(line, sizeof(line), "done produced: %lld consumed: %llu\n", atomic64_read(&producedTotal), consumed_sum());
+    else if(READ_ONCE(stopping))
+        n = scnprintf(line, sizeof(line), "stopped\n");
+    else
+        n = scnprintf(line, sizeof(line), "running\n");
+    return simple_read_from_buffer(buf, len, ppos, line, n);
+}
+
+static __poll_t done_poll(struct file *file, poll_table *wait){
+    poll_wait(file, &doneWait, wait);
+    return atomic_read(&runDone) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static const struct proc_ops done_proc_ops = {
+    .proc_read = done_read,
+    .proc_poll = done_poll,
+    .proc_lseek = noop_llseek,
+};
+
+
+/* Thread contexts ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    consumerStats/producerStats hold one cacheline aligned context per thread
+    and everything else a thread needs for its whole life (batch arrays, the
+    per-uid table) is carved out of one threadPool allocation at load, each
+    piece starting on its own cacheline. The threads never call the
+    allocator themselves. The one thing that has to grow at runtime, the
+    scan's seen entries, comes from its own slab cache.
+*/
+static void *threadPool = NULL;
+
+// a task the continuous scan already produced (see Continuous scanning)
+struct scan_seen {
+    struct hlist_node node;
+    pid_t pid;
+    u64 start_time;
+};
+
+static struct kmem_cache *scanSeenCache = NULL; //struct scan_seen, only with scanInterval
+#define SCAN_QUEUE 1024 //tasks the fork probe can hold per producer between two passes
+
+static size_t pool_piece(size_t n, size_t size){
+    return ALIGN(n * size, SMP_CACHE_BYTES);
+}
+
+// hands out the next piece of the pool
+static void *pool_take(char **cursor, size_t n, size_t size){
+    void *p = *cursor;
+    *cursor += pool_piece(n, size);
+    return p;
+}
+
+// -1 on error, frees whatever it managed to allocate
+static int contexts_init(void){
+    size_t consBytes = pool_piece(batch, sizeof(struct pc_slot)) + pool_piece(batch, sizeof(unsigned long));
+    size_t prodBytes = 2 * pool_piece(batch, sizeof(struct task_struct *));
+    char *cursor;
+
+    if(scanInterval > 0)
+        prodBytes += pool_piece(SCAN_QUEUE, sizeof(struct task_struct *));
+
+    if(multi_uid())
+        consBytes += pool_piece(UID_TABLE_SIZE, sizeof(struct uid_total));
+    if(topK)
+        consBytes += pool_piece(topK, sizeof(struct top_task));
+    if(consMax > 0) //every consumer cons can be raised to gets its context now
+        consumerStats = kcalloc(consMax, sizeof(struct consumer_stats), GFP_KERNEL); //counters start at 0
+    if(prod > 0)
+        producerStats = kcalloc(prod, sizeof(struct producer_stats), GFP_KERNEL);
+    threadPool = kvzalloc(consMax * consBytes + prod * prodBytes, GFP_KERNEL);
+    if(scanInterval > 0)
+        scanSeenCache = KMEM_CACHE(scan_seen, 0);
+    if((consMax > 0 && !consumerStats) || (prod > 0 && !producerStats) || !threadPool || (scanInterval > 0 && !scanSeenCache)){
+        kfree(consumerStats);
+        kfree(producerStats);
+        kvfree(threadPool);
+        kmem_cache_destroy(scanSeenCache);
+        consumerStats = NULL;
+        producerStats = NULL;
+        return -1;
+    }
+    cursor = threadPool;
+    for(int i = 0; i < consMax; i++){
+        struct consumer_stats *c = &consumerStats[i];
+        snprintf(c->name, sizeof(c->name), "Consumer-%d", i+1); //put Consumer-number into the name of the current consumer
+        c->id = i+1;
+        c->slots = pool_take(&cursor, batch, sizeof(struct pc_slot));
+        c->positions = pool_take(&cursor, batch, sizeof(unsigned long));
+        if(multi_uid())
+            c->uidTotals = pool_take(&cursor, UID_TABLE_SIZE, sizeof(struct uid_total));
+        if(topK)
+            c->top = pool_take(&cursor, topK, sizeof(struct top_task));
+        seqcount_init(&c->topSeq);
+    }
+    for(int i = 0; i < prod; i++){
+        producerStats[i].pending = pool_take(&cursor, batch, sizeof(struct task_struct *));
+        producerStats[i].held = pool_take(&cursor, batch, sizeof(struct task_struct *));
+        producerStats[i].nextRing = nSubRings ? i % nSubRings : 0; //spread the producers' starting rings
+        spin_lock_init(&producerStats[i].forkLock);
+        if(scanInterval > 0)
+            producerStats[i].forked = pool_take(&cursor, SCAN_QUEUE, sizeof(struct task_struct *));
+    }
+    return 0;
+}
+
+static void contexts_free(void){
+    kfree(consumerStats);
+    kfree(producerStats);
+    kvfree(threadPool);
+    kmem_cache_destroy(scanSeenCache); //every producer freed its entries before it returned
+}
+
+
+/* Thread placement ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    prodCpus/consCpus are parsed into masks once at load. Thread i of a kind
+    goes on the (i % weight)th CPU of its mask, and the kthread is created on
+    that CPU's node so its stack and task_struct are local too.
+*/
+static cpumask_var_t prodMask;
+static cpumask_var_t consMask;
+
+// -1 on error, unset lists leave the mask empty
+static int parse_cpus(const char *list, struct cpumask *mask, const char *what){
+    if(!list || !*list)
+        return 0;
+    if(cpulist_parse(list, mask) || cpumask_empty(mask)){
+        printk(KERN_ERR "%s is not a valid CPU list\n", what);
+        return -1;
+    }
+    if(!cpumask_subset(mask, cpu_online_mask)){
+        printk(KERN_ERR "%s has CPUs that are not online\n", what);
+        return -1;
+    }
+    return 0;
+}
+
+// CPU for thread i, -1 if that kind of thread isn't pinned
+static int thread_cpu(const struct cpumask *mask, int i){
+    if(cpumask_empty(mask))
+        return -1;
+    return cpumask_nth(i % cpumask_weight(mask), mask);
+}
+
+// slot array of cells slots, with numaBuffer next to Producer-1 (or wherever we are if producers aren't pinned)
+static struct pc_slot *buffer_alloc(unsigned long cells){
+    if(numaBuffer){
+        int cpu = thread_cpu(prodMask, 0);
+        int node = cpu >= 0 ? cpu_to_node(cpu) : numa_node_id();
+        return kmalloc_array_node(cells, sizeof(struct pc_slot), GFP_KERNEL, node);
+    }
+    return kmalloc_array(cells, sizeof(struct pc_slot), GFP_KERNEL); //we allocate memory for the buffer, we use gfp_kernel flag(normal allocation), and we allocate size of a slot * buffersize
+}
+
+// kthread_run, but on cpu (and its node) when cpu >= 0. We keep a reference
+// so exit can join the thread even if it already returned (see Teardown).
+// The thread goes in *slot before it runs, a short bench can be done (and
+// bench_report looking at *slot) before we would get back here. NULL on error
+static int start_thread(int (*fn)(void *), void *arg, int cpu, const char *name, struct task_struct **slot){
+    struct task_struct *thread;
+
+    thread = kthread_create_on_node(fn, arg, cpu >= 0 ? cpu_to_node(cpu) : NUMA_NO_NODE, "%s", name);
+    if(IS_ERR(thread)){
+        WRITE_ONCE(*slot, NULL);
+        return PTR_ERR(thread);
+    }
+    if(cpu >= 0)
+        kthread_bind(thread, cpu);
+    get_task_struct(thread);
+    WRITE_ONCE(*slot, thread);
+    wake_up_process(thread); //full barrier, the thread sees *slot
+    return 0;
+}
+
+static void placement_free(void){
+    free_cpumask_var(prodMask);
+    free_cpumask_var(consMask);
+}
+
+
+// Module initializer ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int __init producer_consumer_init(void){
+    int err = -1;
+    printk(KERN_INFO "producer_consumer module loaded\n"); //just left for testing
+    mutex_lock(&resizeMutex); //from here on parameter writes are resize requests
+    initStarted = true;
+    mutex_unlock(&resizeMutex);
+    startNs = ktime_get_ns();
+    BUILD_BUG_ON(SMP_CACHE_BYTES % sizeof(struct pc_slot)); //slots must pack evenly into cachelines
+    BUILD_BUG_ON(sizeof(struct pc_slot) != 32); //see Slot records
+
+    /* printed out the parameters for testing
+    printk(KERN_INFO "buffSize: %d\n", buffSize);
+    printk(KERN_INFO "prod: %d\n", prod);
+    printk(KERN_INFO "cons: %d\n", cons);
+    printk(KERN_INFO "uuid: %u\n", uuid);
+
+    Testing passed!
+    */
+
+    //Not required, but I am going to check some edge cases 
+    //and throw an error if they occur
+    if(buffSize < 1){
+        printk(KERN_ERR "buffSize must be greater than 0\n");
+        return -1;
+    }
+    if(prod < 0){
+        printk(KERN_ERR "prod must be greater than or equal to 0\n");
+        return -1;
+    }
+    if(cons < 0){
+        printk(KERN_ERR "cons must be greater than or equal to 0\n");
+        return -1;
+    }
+    if(consMax == 0)
+        consMax = cons;
+    if(consMax < cons || (ringMode == RING_SHARDED && consMax != cons)){ //sub-rings are made for cons
+        printk(KERN_ERR "consMax must be at least cons (and can't be raised with ringMode 2)\n");
+        return -1;
+    }
+    consSeen = cons;
+    if(ringMode != RING_SEMAPHORE && ringMode != RING_LOCKFREE && ringMode != RING_SHARDED){
+        printk(KERN_ERR "ringMode must be 0, 1 or 2\n");
+        return -1;
+    }
+    if(ringMode == RING_SHARDED && buffSize < cons){ //every consumer needs at least one cell
+        printk(KERN_ERR "buffSize must be at least cons with ringMode 2\n");
+        return -1;
+    }
+    if(pow2Ring && buffSize > (1 << 30)){ //has to round up without overflowing an int
+        printk(KERN_ERR "buffSize must be at most 2^30 with pow2Ring\n");
+        return -1;
+    }
+    nSubRings = max(cons, 1); //only used with ringMode 2
+    if(batch < 1){
+        printk(KERN_ERR "batch must be greater than 0\n");
+        return -1;
+    }
+    if(waitMode != WAIT_SLEEP && waitMode != WAIT_SPIN && waitMode != WAIT_ADAPTIVE){
+        printk(KERN_ERR "waitMode must be 0, 1 or 2\n");
+        return -1;
+    }
+    if(batch > buffSize) //can never have more than buffSize slots reserved at once
+        batch = buffSize;
+    if(nrUids > 0 && allUids){
+        printk(KERN_ERR "use either uids or allUids, not both\n");
+        return -1;
+    }
+    sort(uids, nrUids, sizeof(uint), uid_cmp, NULL); //uid_wanted does a binary search
+    if(scanInterval < 0){
+        printk(KERN_ERR "scanInterval must be greater than or equal to 0\n");
+        return -1;
+    }
+    if(logMode != LOG_PRINTK && logMode != LOG_TRACE){
+        printk(KERN_ERR "logMode must be 0 or 1\n");
+        return -1;
+    }
+    if(topK < 0 || topK > TOPK_MAX){
+        printk(KERN_ERR "topK must be between 0 and %d\n", TOPK_MAX);
+        return -1;
+    }
+    if(exportSize < 0 || exportSize > EXPORT_MAX){
+        printk(KERN_ERR "exportSize must be between 0 and %d\n", EXPORT_MAX);
+        return -1;
+    }
+    if(bench < 0){
+        printk(KERN_ERR "bench must be greater than or equal to 0\n");
+        return -1;
+    }
+    if(logMode == LOG_TRACE && traceSize < 1){
+        printk(KERN_ERR "traceSize must be greater than 0\n");
+        return -1;
+    }
+    consumerOps = handler_find(handler);
+    if(!consumerOps){
+        printk(KERN_ERR "handler must be elapsed or rss\n");
+        return -1;
+    }
+    if(consumerOps->init && consumerOps->init())
+        return -1; //it said why
+    
+    /* Program Flow
+        1. Initialize semaphores
+        2. Initialize buffer and thread contexts
+        3. Create consumers
+        4. Create producers
+        5. Create the stats endpoint
+        6. Wait for exit
+        7. end all threads and free memory
+    */
+
+    // 1. Initialize semaphores ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    sema_init(&empty, buffSize); //we make the empty the buffsize
+    sema_init(&full, 0); //we make full 0, since we can add (no slots not full)
+    sema_init(&mutex, 1); // binary semaphore set to 1 (unlocked)
+
+    // 2. Initialize buffer ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    if(!zalloc_cpumask_var(&prodMask, GFP_KERNEL) || !zalloc_cpumask_var(&consMask, GFP_KERNEL)
+        || parse_cpus(prodCpus, prodMask, "prodCpus") || parse_cpus(consCpus, consMask, "consCpus"))
+        goto fail_placement;
+    buffer = buffer_alloc(buffer_cells());
+    if(!buffer){ //if we fail to allocate memory for buffer
+        printk(KERN_ERR "Failed to allocate memory for buffer\n");
+        goto fail_placement;
+    }
+    ringMask = ring_cells(buffSize) - 1;
+    if(ringMode == RING_LOCKFREE) //the lock-free ring needs its sequence numbers set up
+        lf_init(&lfRing, buffer, buffSize, prod == 1, consMax == 1); //cons can go up later, consMax can't
+    if(ringMode == RING_SHARDED && shard_init()){
+        printk(KERN_ERR "Failed to allocate memory for sub-rings\n");
+        goto fail_buffer;
+    }
+    if(logMode == LOG_TRACE){ //trace buffer has to exist before any thread logs
+        if(trace_init()){
+            printk(KERN_ERR "Failed to allocate memory for trace buffer\n");
+            goto fail_trace; //trace_free copes with the half made buffers
+        }
+        traceProc = proc_create("producer_consumer_trace", 0444, NULL, &trace_proc_ops);
+        if(!traceProc)
+            printk(KERN_ERR "Failed to create /proc/producer_consumer_trace\n");
+    }
+    if(contexts_init()){ //nothing below this allocates per thread
+        printk(KERN_ERR "Failed to allocate memory for thread contexts\n");
+        goto fail_trace;
+    }
+    fork_probe_init(); //before the producers' first walk, so no fork falls in between
+    if(export_init()){
+        printk(KERN_ERR "Failed to allocate memory for the export ring\n");
+        goto fail_probe;
+    }
+
+    // 3. Create Consumers ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    if(consMax > 0){
+        printk(KERN_INFO "Creating consumer threads\n"); //we need to keep track of task structs to kill them later, cannot lose(floating memory)
+        consumerThreads = kcalloc(consMax, sizeof(struct task_struct *), GFP_KERNEL); //allocate the space for consumer thread, NULL until one is started
+        if(!consumerThreads){ //failed to allocate consumer thread
+            printk(KERN_ERR "Failed to allocate memory for consumer threads\n");
+            goto fail_export;
+        }
+        for(int i = 0; i < cons; i++){ //loop over all consumer threads, we create consumer threads
+            err = start_thread(kthread_consumer, &consumerStats[i], thread_cpu(consMask, i), consumerStats[i].name, &consumerThreads[i]); //we run the created consumer thread(function(below),its context as argument passed into function,where it runs,name of thread)
+            if (err) {  //if kthread run fails then we cannot create thread consumer, its slot is NULL so join_threads skips it
+                printk(KERN_INFO "ERROR: Cannot create thread Consumer\n");
+                goto fail_threads;
+            }
+        }
+    }
+
+    benchStartNs = ktime_get_ns(); //consumers are up, the clock starts with the first producer
+
+    // 4. Create producers ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    if(prod > 0){ //each producer gets the PIDs where pid % prod == its shard
+        printk(KERN_INFO "Creating producer threads\n"); 
+        producerThreads = kcalloc(prod, sizeof(struct task_struct *), GFP_KERNEL); //NULL until started, for the unwind
+        if(!producerThreads){
+            printk(KERN_ERR "Failed to allocate memory for producer threads\n");
+            goto fail_threads;
+        }
+        for(int i = 0; i < prod; i++){
+            char name[20];
+            sprintf(name, "Producer-%d", i+1);
+            err = start_thread(kthread_producer, (void *)(long)i, thread_cpu(prodMask, i), name, &producerThreads[i]); //the shard number is the argument
+            if (err) { //if there is error
+                printk(KERN_INFO "ERROR: Cannot create thread Producer-%d\n", i+1);
+                goto fail_threads;
+            }
+        }
+    }
+
+    // 5. Stats endpoint ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    statsProc = proc_create_single("producer_consumer", 0444, NULL, stats_show); //last, everything it reads exists now
+    if(!statsProc)
+        printk(KERN_ERR "Failed to create /proc/producer_consumer\n");
+    doneProc = proc_create("producer_consumer_done", 0444, NULL, &done_proc_ops);
+    if(!doneProc)
+        printk(KERN_ERR "Failed to create /proc/producer_consumer_done\n");
+    if(exportArea){
+        exportProc = proc_create("producer_consumer_export", 0644, NULL, &export_proc_ops); //writable, the reader maps it to store tail
+        if(!exportProc)
+            printk(KERN_ERR "Failed to create /proc/producer_consumer_export\n");
+    }
+    done_check(); //with no producers we are done already
+
+    mutex_lock(&resizeMutex);
+    resizeReady = true; //everything a resize touches exists now
+    mutex_unlock(&resizeMutex);
+    return 0;
+
+    // Unwind ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    // same order as exit, each label undoes the step that succeeded before the failure
+fail_threads:
+    stop_all_threads(); //whatever got started, NULL entries are skipped
+    buffer_release(); //items they already produced hold task references
+    kfree(producerThreads);
+    kfree(consumerThreads);
+fail_export:
+    export_free();
+fail_probe:
+    fork_probe_exit();
+    contexts_free();
+fail_trace:
+    proc_remove(traceProc);
+    trace_free();
+    kfree(subRings); //NULL unless ringMode 2
+fail_buffer:
+    kfree(buffer);
+fail_placement:
+    placement_free();
+    return err;
+}
+/* Batches ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    The producer collects up to batch matching tasks in pending[] and then
+    publishes them together. It blocks for the first free slot only and takes
+    whatever else is free right now with down_trylock, so a partly full buffer
+    still gets filled (test case 1 expects exactly buffSize items with no
+    consumer). Whatever didn't fit stays in pending[] for the next round.
+    Consumers do the same thing from the other side.
+*/
+static pid_t pending_pid(struct task_struct *task){
+    return task ? task->pid : 0; //NULL is a bench item
+}
+
+static void drop_published(struct task_struct **pending, int *npending, int n){
+    for(int i = n; i < *npending; i++) //shift the unpublished tasks to the front
+        pending[i - n] = pending[i];
+    *npending -= n;
+}
+
+// returns nonzero if we were interrupted
+static int produce_batch_sem(int id, struct task_struct **pending, int *npending, int *count){
+    int n = 1;
+    // wait for empty using down_interruptible to allow for module to be unloaded
+    //down_interruptiable means we can interrupt task and we can decrement
+    if (wait_down(&empty, PC_WAIT_EMPTY, &producerStats[id - 1].wait)) return -1; // we move empty down, if it cannot aquire a lock it waits. Interrupted(true) --> returns
+    if (pc_should_stop()) return -1; //woken by exit, there may be no slot behind this at all
+    while(n < *npending && !down_trylock(&empty)) //reserve the rest of the batch without sleeping
+        n++;
+    if (traced_down(&mutex, PC_WAIT_MUTEX)){ // we move lock down, but cannot move we wait. Interrupted(true) --> give back the slots
+        for(int i = 0; i < n; i++)
+            traced_up(&empty, PC_WAIT_EMPTY);
+        return -1;
+    }
+    // Critical section ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    for(int i = 0; i < n; i++){
+        unsigned long tail = buffer_slot(tailCount); //this is how we keep track of where we are in the tail
+        slot_fill(&buffer[tail], pending[i]); // we add things to the tail
+        // print with this format: [Producer-1] Produced Item#-12 at buffer index:1 for PID:136042
+        (*count)++; //increment the item count for print
+        log_produced(id, *count, tail, pending_pid(pending[i])); // we tell which item was produced where
+        tailCount++;
+    }
+    // end critical section ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    traced_up(&mutex, PC_WAIT_MUTEX); //increment mutex, release lock
+    for(int i = 0; i < n; i++)
+        traced_up(&full, PC_WAIT_FULL); //increment full, addded task (we tell consumer there is stuff to take)
+    drop_published(pending, npending, n);
+    return 0;
+}
+
+// returns nonzero if we were interrupted or told to stop
+static int produce_batch_lf(int id, struct task_struct **pending, int *npending, int *count){
+    int n = 1;
+    int index;
+    if(lf_push(&lfRing, pending[0], &index, &producerStats[id - 1].wait)) return -1; //only sleeps if the ring is full
+    (*count)++;
+    log_produced(id, *count, index, pending_pid(pending[0]));
+    while(n < *npending && lf_try_push(&lfRing, pending[n], &index)){
+        (*count)++;
+        log_produced(id, *count, index, pending_pid(pending[n]));
+        n++;
+    }
+    lf_wake_consumers(&lfRing); //one wakeup for the whole batch
+    drop_published(pending, npending, n);
+    return 0;
+}
+
+// deals the batch round-robin over the sub-rings, skipping full ones.
+// returns nonzero if we were interrupted or told to stop
+static int produce_batch_shard(int id, struct task_struct **pending, int *npending, int *count){
+    struct producer_stats *ps = &producerStats[id - 1];
+    int n = 0;
+    int index;
+
+    for(;;){
+        for(int misses = 0; n < *npending && misses < nSubRings; ps->nextRing = (ps->nextRing + 1) % nSubRings){
+            if(!lf_try_push(&subRings[ps->nextRing], pending[n], &index)){
+                misses++; //full, give the next one a go
+                continue;
+            }
+            misses = 0;
+            (*count)++;
+            log_produced(id, *count, index, pending_pid(pending[n]));
+            n++;
+        }
+        if(n > 0) //whatever didn't fit stays pending for the next call
+            break;
+        if(wait_event_strategy(&ps->wait, shardNotFull, PC_WAIT_NOT_FULL, shard_has_space() || pc_should_stop()))
+            return -1;
+        if(pc_should_stop())
+            return -1;
+    }
+    for(int i = 0; i < nSubRings; i++) //one wakeup per ring for the whole batch
+        lf_wake_consumers(&subRings[i]);
+    drop_published(pending, npending, n);
+    return 0;
+}
+
+static int produce_batch(int id, struct task_struct **pending, int *npending, int *count){
+    if(ringMode == RING_LOCKFREE)
+        return produce_batch_lf(id, pending, npending, count);
+    if(ringMode == RING_SHARDED)
+        return produce_batch_shard(id, pending, npending, count);
+    return produce_batch_sem(id, pending, npending, count);
+}
+
+// adds task to the batch and publishes the batch once it is full, nonzero if we have to stop
+static int produce_task(int shard, struct task_struct **pending, int *npending, int *count, struct task_struct *task){
+    int stopped = 0;
+
+    if(pc_should_stop()) //don't keep filling the buffer for consumers that are gone
+        return -1;
+    pending[(*npending)++] = task; // add task to the batch
+    if(*npending == batch){
+        stopped = produce_batch(shard+1, pending, npending, count);
+        WRITE_ONCE(producerStats[shard].produced, *count); //so /proc sees it
+    }
+    return stopped;
+}
+
+// publishes the last partial batch, nonzero if we have to stop
+static int produce_flush(int shard, struct task_struct **pending, int *npending, int *count){
+    int stopped = 0;
+
+    while(!stopped && *npending > 0){
+        stopped = produce_batch(shard+1, pending, npending, count);
+        WRITE_ONCE(producerStats[shard].produced, *count);
+    }
+    return stopped;
+}
+
+/* Continuous scanning ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    With scanInterval set each producer rescans every scanInterval ms and only
+    produces tasks it hasn't produced before.
+
+    New processes come from a probe on the sched_process_fork tracepoint
+    (found with for_each_kernel_tracepoint, it isn't exported by name). The
+    probe runs in the parent right after the child is linked into the process
+    list, takes a reference on it and puts it in the forked array of the
+    producer whose shard it falls in. A pass just takes that array, so it
+    costs O(new processes), not O(processes).
+
+    The process list still gets walked on the first pass (everything that
+    was there before the probe), when the probe couldn't be registered, and
+    when the probe had to drop tasks because a producer's array was full.
+    tasklist_lock isn't exported to modules, so the walk goes forwards under
+    rcu_read_lock (an unlinked task's prev pointer is poisoned) and skips the
+    tasks that started before the newest one the previous pass saw (the
+    watermark) with one compare of start_time.
+
+    fork takes start_time a little before it links the task, so a task can be
+    linked after a walk already moved the watermark past it, and one the walk
+    found can still come from the probe next pass. The walk goes
+    SCAN_SLACK_NS back from the watermark, and the seen table (pid +
+    start_time of what we produced inside that window) stops both from being
+    produced twice. Entries older than the window get pruned, so the table
+    only grows with churn.
+
+    The walk can't sleep under rcu_read_lock: it only collects (with a
+    reference on each task) and publishing happens after.
+*/
+#define SCAN_SLACK_NS NSEC_PER_SEC
+#define SCAN_HASH_BITS 10
+
+struct scan_state {
+    u64 watermark; //newest start_time the last pass saw
+    struct task_struct **found; //tasks collected this pass, oldest first
+    int nfound;
+    int capacity; //never below SCAN_QUEUE, a whole forked array fits
+    bool walked; //the list was walked once, from now on the probe is enough
+    DECLARE_HASHTABLE(seen, SCAN_HASH_BITS);
+};
+
+static DECLARE_WAIT_QUEUE_HEAD(scanWait); //only exit wakes it, producers just sleep here until the next pass
+static struct tracepoint *forkTracepoint = NULL; //NULL if the probe isn't registered
+
+static void fork_probe(void *data, struct task_struct *parent, struct task_struct *child){
+    struct producer_stats *p;
+
+    if(!thread_group_leader(child)) //a new thread, for_each_process doesn't see those either
+        return;
+    p = &producerStats[child->pid % prod];
+    spin_lock(&p->forkLock);
+    if(p->nforked < SCAN_QUEUE){
+        get_task_struct(child); //the producer puts it
+        p->forked[p->nforked++] = child;
+    } else {
+        p->forkOverflow = true;
+    }
+    spin_unlock(&p->forkLock);
+}
+
+static void fork_probe_find(struct tracepoint *tp, void *priv){
+    if(!strcmp(tp->name, "sched_process_fork"))
+        *(struct tracepoint **)priv = tp;
+}
+
+// without the probe every pass walks the list, slower but it still works
+static void fork_probe_init(void){
+    struct tracepoint *tp = NULL;
+
+    if(scanInterval <= 0 || prod <= 0)
+        return;
+    for_each_kernel_tracepoint(fork_probe_find, &tp);
+    if(!tp || tracepoint_probe_register(tp, fork_probe, NULL)){
+        printk(KERN_ERR "Could not hook sched_process_fork, every scan walks the whole process list\n");
+        return;
+    }
+    forkTracepoint = tp;
+}
+
+// once the producers are gone
+static void fork_probe_exit(void){
+    if(!forkTracepoint)
+        return;
+    tracepoint_probe_unregister(forkTracepoint, fork_probe, NULL);
+    tracepoint_synchronize_unregister(); //no probe still running after this
+    forkTracepoint = NULL;
+    for(int i = 0; i < prod; i++){
+        for(int j = 0; j < producerStats[i].nforked; j++)
+            put_task_struct(producerStats[i].forked[j]);
+        producerStats[i].nforked = 0;
+    }
+}
+
+static bool scan_was_seen(struct scan_state *st, struct task_struct *task){
+    struct scan_seen *e;
+
+    hash_for_each_possible(st->seen, e, node, task->pid){
+        if(e->pid == task->pid && e->start_time == task->start_time)
+            return true;
+    }
+    return false;
+}
+
+static void scan_forget_found(struct scan_state *st){
+    for(int i = 0; i < st->nfound; i++)
+        put_task_struct(st->found[i]);
+    st->nfound = 0;
+}
+
+// walks the list for our new tasks, into st->found, returns the new watermark
+static u64 scan_walk(struct scan_state *st, int shard){
+    struct task_struct *task;
+    u64 watermark;
+
+    for(;;){
+        bool overflow = false;
+        struct task_struct **bigger;
+
+        watermark = st->watermark;
+        rcu_read_lock();
+        for_each_process(task){ //forwards only, see above
+            if(task->start_time + SCAN_SLACK_NS < st->watermark) //was there last pass
+                continue;
+            if(task->start_time > watermark)
+                watermark = task->start_time;
+            if(!uid_wanted(task->cred->uid.val) || task->pid % prod != shard || scan_was_seen(st, task))
+                continue;
+            if(st->nfound == st->capacity){
+                overflow = true;
+                break;
+            }
+            get_task_struct(task); //so it stays valid after rcu_read_unlock
+            st->found[st->nfound++] = task;
+        }
+        rcu_read_unlock();
+        if(!overflow)
+            return watermark;
+        // more new tasks than room, grow and walk again
+        scan_forget_found(st);
+        bigger = kvmalloc_array(st->capacity * 2, sizeof(struct task_struct *), GFP_KERNEL);
+        if(!bigger)
+            return st->watermark; //try again next pass
+        kvfree(st->found);
+        st->found = bigger;
+        st->capacity *= 2;
+    }
+}
+
+// collects our new tasks into st->found, returns the new watermark
+static u64 scan_collect(struct scan_state *st, int shard){
+    struct producer_stats *p = &producerStats[shard];
+    u64 watermark = st->watermark;
+    bool walk;
+    int n = 0;
+
+    spin_lock(&p->forkLock);
+    walk = !forkTracepoint || !st->walked || p->forkOverflow;
+    memcpy(st->found, p->forked, p->nforked * sizeof(struct task_struct *)); //capacity >= SCAN_QUEUE
+    st->nfound = p->nforked;
+    p->nforked = 0;
+    p->forkOverflow = false;
+    spin_unlock(&p->forkLock);
+    if(walk){ //the walk finds all of these too
+        scan_forget_found(st);
+        st->walked = true;
+        return scan_walk(st, shard);
+    }
+    for(int i = 0; i < st->nfound; i++){ //in fork order already
+        struct task_struct *task = st->found[i];
+        if(task->start_time > watermark)
+            watermark = task->start_time;
+        if(!uid_wanted(task_uid(task).val) || scan_was_seen(st, task)){
+            put_task_struct(task);
+            continue;
+        }
+        st->found[n++] = task;
+    }
+    st->nfound = n;
+    return watermark;
+}
+
+// remembers what we produced and forgets what fell out of the slack window
+static void scan_record(struct scan_state *st, u64 watermark){
+    struct scan_seen *e;
+    struct hlist_node *tmp;
+    int bkt;
+
+    for(int i = 0; i < st->nfound; i++){
+        if(st->found[i]->start_time + SCAN_SLACK_NS < watermark) //can't be walked again, no need to remember it
+            continue;
+        e = kmem_cache_alloc(scanSeenCache, GFP_KERNEL);
+        if(!e)
+            continue; //worst case it gets produced again
+        e->pid = st->found[i]->pid;
+        e->start_time = st->found[i]->start_time;
+        hash_add(st->seen, &e->node, e->pid);
+    }
+    hash_for_each_safe(st->seen, bkt, tmp, e, node){
+        if(e->start_time + SCAN_SLACK_NS < watermark){
+            hash_del(&e->node);
+            kmem_cache_free(scanSeenCache, e);
+        }
+    }
+    st->watermark = watermark;
+}
+
+static void scan_free(struct scan_state *st){
+    struct scan_seen *e;
+    struct hlist_node *tmp;
+    int bkt;
+
+    scan_forget_found(st);
+    kvfree(st->found);
+    hash_for_each_safe(st->seen, bkt, tmp, e, node){
+        hash_del(&e->node);
+        kmem_cache_free(scanSeenCache, e);
+    }
+    kfree(st);
+}
+
+static int producer_scan_loop(int shard, struct task_struct **pending){
+    struct scan_state *st;
+    int npending = 0;
+    int count = 0; //keeps counting across passes
+    int stopped = 0;
+
+    st = kzalloc(sizeof(*st), GFP_KERNEL);
+    if(st){
+        st->capacity = SCAN_QUEUE;
+        st->found = kvmalloc_array(st->capacity, sizeof(struct task_struct *), GFP_KERNEL);
+    }
+    if(!st || !st->found){
+        printk(KERN_ERR "Failed to allocate memory for Producer-%d scan\n", shard+1);
+        kfree(st);
+        return -ENOMEM;
+    }
+    hash_init(st->seen);
+    while(!pc_should_stop()){
+        u64 watermark = scan_collect(st, shard);
+
+        for(int i = 0; !stopped && i < st->nfound; i++) //oldest first so Item# follows creation order
+            stopped = produce_task(shard, pending, &npending, &count, st->found[i]);
+        if(!stopped)
+            stopped = produce_flush(shard, pending, &npending, &count);
+        npending = 0; //only left over if we are stopping
+        scan_record(st, watermark);
+        scan_forget_found(st); //published slots hold their own references
+        if(stopped)
+            break;
+        wait_event_interruptible_timeout(scanWait, pc_should_stop(), msecs_to_jiffies(scanInterval));
+    }
+    scan_free(st);
+    return 0;
+}
+
+/* RCU walk ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    Instead of one long for_each_process that sleeps every time the buffer is
+    full, the walk goes through the PIDs in numeric order, like /proc readdir
+    does: find_ge_pid gives the next PID at or above our cursor, pid_task the
+    process for it. The cursor is just a number, so it doesn't matter what
+    exits while we aren't looking and we can drop the RCU lock whenever we want.
+
+    Each chunk looks at up to RCU_CHUNK PIDs (or until a batch is full) under
+    rcu_read_lock, takes a reference on every match and then unlocks. Only
+    after that does it publish, which is where it might sleep.
+    A PID number is only passed once, so every process is produced once.
+*/
+#define RCU_CHUNK 256
+
+static int producer_rcu_walk(int shard, struct task_struct **pending, struct task_struct **held){
+    int nr = 1; //next PID to look at, 0 is the idle task which for_each_process skips too
+    int count = 0;
+    int npending = 0;
+    int stopped = 0;
+    bool done = false;
+
+    while(!done && !stopped){
+        int n = 0;
+
+        rcu_read_lock();
+        for(int visited = 0; visited < RCU_CHUNK && n < batch; visited++){
+            struct pid *pid = find_ge_pid(nr, &init_pid_ns);
+            struct task_struct *task;
+
+            if(!pid){ //past the last PID
+                done = true;
+                break;
+            }
+            nr = pid_nr(pid) + 1;
+            task = pid_task(pid, PIDTYPE_TGID); //NULL for threads, they aren't processes
+            if(!task || !uid_wanted(__task_cred(task)->uid.val) || task->pid % prod != shard)
+                continue;
+            get_task_struct(task); //keeps it valid once we unlock
+            held[n++] = task;
+        }
+        rcu_read_unlock();
+
+        for(int i = 0; !stopped && i < n; i++) //now we are allowed to sleep
+            stopped = produce_task(shard, pending, &npending, &count, held[i]);
+        if(!stopped)
+            stopped = produce_flush(shard, pending, &npending, &count);
+        for(int i = 0; i < n; i++) //published slots hold their own references
+            put_task_struct(held[i]);
+        cond_resched();
+    }
+    return stopped;
+}
+
+/* Bench producer ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    With bench set the producers split N synthetic items between them and
+    push them through exactly the same batch path as real tasks, a NULL task
+    is what makes slot_fill write a synthetic record.
+*/
+static void producer_bench(int shard, struct task_struct **pending){
+    int items = bench / prod + (shard < bench % prod); //our share
+    int npending = 0;
+    int count = 0;
+    int stopped = 0;
+
+    for(int i = 0; !stopped && i < items; i++){
+        stopped = produce_task(shard, pending, &npending, &count, NULL);
+        cond_resched(); //the buffer might never be full long enough for us to sleep
+    }
+    if(!stopped)
+        produce_flush(shard, pending, &npending, &count);
+}
+
+//producer thread method
+static int kthread_producer(void *arg){
+    struct task_struct *task; //we create task pointer, stores the current task that our producer is looking at
+    int shard = (long)arg; //which PIDs belong to us, we are Producer-(shard+1)
+    struct task_struct **pending = producerStats[shard].pending; //tasks found but not published yet
+    int npending = 0;
+    int count = 0; //intialize the count, each producer numbers its own items
+    int ret = 0;
+
+    if(bench){
+        producer_bench(shard, pending);
+        producer_finished(shard);
+        return 0;
+    }
+    if(scanInterval > 0)
+        return producer_scan_loop(shard, pending);
+    if(rcuWalk){
+        producer_rcu_walk(shard, pending, producerStats[shard].held);
+        producer_finished(shard);
+        return 0;
+    }
+    for_each_process(task){ //for each process running on the system
+        //if the task belongs to the user (uid = who owns the task) and falls in our shard
+        if(uid_wanted(task->cred->uid.val) && task->pid % prod == shard){
+            if(produce_task(shard, pending, &npending, &count, task)){
+                ret = -1;
+                break;
+            }
+        }
+    }
+    if(!ret)
+        produce_flush(shard, pending, &npending, &count);
+    producer_finished(shard);
+    return 0;
+}
+
+// fills slots from our own sub-ring, or steals from the others when it is empty.
+// indexes get the buffer slots, returns how many we took or -1 if we have to stop
+static int shard_take(struct consumer_stats *stats, struct pc_slot *slots, unsigned long *indexes){
+    int own = stats->id - 1;
+    int n;
+
+    for(;;){
+        n = lf_pop_some(&subRings[own], slots, indexes, batch);
+        if(n == batch && nSubRings > 1 && lf_has_items(&subRings[own])) //backlog, let a sleeping neighbour help
+            lf_wake_consumers(&subRings[(own + 1) % nSubRings]);
+        for(int k = 1; !n && k < nSubRings; k++){ //ours is empty, try the next ones over
+            n = lf_pop_some(&subRings[(own + k) % nSubRings], slots, indexes, batch);
+            WRITE_ONCE(stats->stolen, stats->stolen + n);
+        }
+        if(n > 0){
+            shard_wake_producers(); //one wakeup for the whole batch
+            return n;
+        }
+        if(wait_event_strategy(&stats->wait, subRings[own].notEmpty, PC_WAIT_NOT_EMPTY, shard_has_items() || pc_should_stop()))
+            return -1;
+        if(pc_should_stop())
+            return -1;
+    }
+}
+
+// true if cons went below our id and we should exit, see Runtime resizing
+static bool consumer_retire(struct consumer_stats *stats){
+    bool retire;
+
+    if(stats->id <= READ_ONCE(cons)) //every batch, no lock
+        return false;
+    spin_lock(&consLock); //a raise either sees that we retired or we see the raise
+    retire = stats->id > cons;
+    stats->retired = retire;
+    spin_unlock(&consLock);
+    return retire;
+}
+
+// true if the full we just took was one of a cons drop's, there is no item
+// behind it. Passed on while a consumer above cons is still around
+static bool retire_token(struct consumer_stats *stats){
+    bool pass = false;
+
+    if(atomic_dec_if_positive(&retireWakes) < 0) //just a read unless cons dropped
+        return false;
+    spin_lock(&consLock);
+    for(int i = cons; stats->id <= cons && i < consSeen && !pass; i++)
+        pass = READ_ONCE(consumerThreads[i]) && !consumerStats[i].retired;
+    spin_unlock(&consLock);
+    if(pass){
+        atomic_inc(&retireWakes);
+        up(&full); //goes to the next sleeper in line
+    }
+    return true;
+}
+
+static int kthread_consumer(void *arg){
+    struct consumer_stats *stats = arg; // our own context, stats->name is the name of thread we are using
+    struct pc_slot *slots = stats->slots; //the batch we took
+    unsigned long *positions = stats->positions; //and where each one came from
+    int n;
+    //var to store current time
+    printk(KERN_INFO "Consumer thread created\n"); //for testing
+    while (!pc_should_stop() && !consumer_retire(stats)) //while kernel threasd is running, consumer runs indefintely(producer stops)
+    {
+        if(ringMode == RING_SHARDED){
+            n = shard_take(stats, slots, positions);
+            if(n < 0) break;
+            consume_batch(stats, slots, positions, n); //positions are buffer indexes here
+            consumer_batch_done();
+            continue;
+        }
+        if(ringMode == RING_LOCKFREE){
+            n = lf_pop(&lfRing, &slots[0], &positions[0], &stats->wait, stats->id); //only sleeps if the ring is empty
+            if(n < 0) break;
+            if(n) continue; //cons dropped below us, the loop retires us
+            for(n = 1; n < batch && lf_try_pop(&lfRing, &slots[n], &positions[n]); n++)
+                ;
+            lf_wake_producer(&lfRing); //one wakeup for the whole batch
+            consume_batch(stats, slots, positions, n);
+            consumer_batch_done();
+            continue;
+        }
+        // wait for full using down_interruptible to allow for module to be unloaded
+        if (wait_down(&full, PC_WAIT_FULL, &stats->wait)) break; //break if interrupted, otherwise just wait
+        if (pc_should_stop()) break; //woken by exit, there may be no item behind this at all
+        if (retire_token(stats)) continue; //woken by a cons drop, the loop retires us if it was for us
+        for(n = 1; n < batch && !down_trylock(&full) && !retire_token(stats); n++) //take whatever else is ready without sleeping
+            ;
+        if (traced_down(&mutex, PC_WAIT_MUTEX)) break; //break if interrupted, otherwise just wait
+        // Critical section ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+        for(int i = 0; i < n; i++){ //n contiguous slots starting at head, only copy them out here
+            slots[i] = buffer[buffer_slot(headCount)]; //we take from the head
+            positions[i] = headCount++; //we move the head to the next slot in buffer
+        }
+        // end critical section ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+        traced_up(&mutex, PC_WAIT_MUTEX); //we release lock
+        for(int i = 0; i < n; i++)
+            traced_up(&empty, PC_WAIT_EMPTY); //signal empty slot
+        // signal the semaphore
+        consume_batch(stats, slots, positions, n); //the handler runs without the lock
+        consumer_batch_done(); //see Completion
+    }
+    return 0;
+}
+
+/* Teardown ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    exit sets stopping first and then wakes every thread that could be asleep
+    at once, so they all wind down in parallel, and only after that joins
+    them one by one. The time rmmod takes doesn't grow with cons.
+
+    Ring queues get a wake_up_all and every wait condition checks the flag.
+    Semaphores can't be broadcast, so full gets one up per consumer (every
+    one that ever ran, a retiring one may still be asleep) and
+    empty one per producer. A thread checks the flag right after each down
+    and before it takes anything more, so it uses at most one of those ups
+    and there is one for everybody. The counts are wrong afterwards, but
+    nobody looks at them again.
+
+    start_thread holds a reference on every thread, so kthread_stop is fine
+    even for a one-shot producer that returned long ago.
+*/
+static void wake_all_threads(void){
+    for(int i = 0; i < consSeen; i++)
+        up(&full);
+    for(int i = 0; i < prod; i++)
+        up(&empty);
+    if(ringMode == RING_LOCKFREE){
+        wake_up_all(&lfRing.notEmpty);
+        wake_up_all(&lfRing.notFull);
+    }
+    for(int i = 0; subRings && i < nSubRings; i++)
+        wake_up_all(&subRings[i].notEmpty);
+    wake_up_all(&shardNotFull);
+    wake_up_all(&scanWait);
+    wake_up_all(&doneWait); //readers blocked on /proc/producer_consumer_done
+    wake_up_all(&exportWait); //and pollers of /proc/producer_consumer_export, they get EPOLLHUP
+}
+
+static void join_threads(struct task_struct **threads, int n){
+    for(int i = 0; threads && i < n; i++){
+        if(!threads[i]) //a consumer context that never got a thread
+            continue;
+        kthread_stop(threads[i]); //returns right away if it already exited
+        put_task_struct(threads[i]);
+    }
+}
+
+static void stop_all_threads(void){
+    WRITE_ONCE(stopping, true);
+    smp_mb(); //flag before any wakeup, a woken thread has to see it
+    wake_all_threads();
+    join_threads(producerThreads, prod);
+    join_threads(consumerThreads, consSeen); //retired ones too
+}
+
+/* Runtime resizing ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    buffSize and cons can be written in /sys/module/producer_consumer/parameters
+    while the module is loaded. resizeMutex lets one write through at a time,
+    writes while init or exit are running get -EBUSY.
+
+    cons: contexts for consMax consumers are made at load, so nothing moves.
+    Raising cons starts threads for the contexts that don't have a running
+    one, lowering it is left to the consumers: one whose id is above cons
+    exits before its next batch. It decides that under consLock, so a raise
+    either sees it retired and starts a new thread or it sees the raise and
+    keeps going. Its counters stay where they are and everything that adds
+    them up goes over consSeen. Not with ringMode 2, there every consumer owns
+    a sub-ring.
+
+    A lowered cons also wakes the consumers that have to go. The lock-free
+    ring's wait checks cons, so a wake_up_all does it. full can't wake anyone
+    in particular, so the drop ups it once per consumer that retires and
+    counts those in retireWakes. Whoever takes a full while retireWakes isn't
+    0 takes one of those instead of an item; if it isn't retiring itself it
+    ups full again for the next one in line, as long as some consumer above
+    cons is still around.
+
+    buffSize, ringMode 0 only (the lock-free rings have no lock that would stop
+    everyone): holding the mutex semaphore means nobody is touching the
+    buffer, so the items get copied to a new array at the same free-running
+    positions and from then on positions wrap at the new size. Growing ups
+    empty by the difference afterwards. Shrinking first takes the difference
+    out of empty, like a producer reserving slots would, so by the time we
+    hold the mutex the new size is enough for whatever is in the buffer. It
+    doesn't wait for those slots (the write holds kernel_param_lock, every
+    other parameter would hang behind it): if they aren't free right now it
+    gives them back and the write gets -EBUSY.
+*/
+
+// new buffer of size slots, see above
+static int buffer_resize(int size){
+    unsigned long cells = ring_cells(size);
+    struct pc_slot *resized, *old;
+    int oldSize = buffSize, taken = 0;
+
+    if(ringMode != RING_SEMAPHORE){
+        printk(KERN_ERR "buffSize can only be changed while loaded with ringMode 0\n");
+        return -EBUSY;
+    }
+    if(size < 1 || (pow2Ring && size > (1 << 30))){
+        printk(KERN_ERR "buffSize must be greater than 0 (and at most 2^30 with pow2Ring)\n");
+        return -EINVAL;
+    }
+    if(size == oldSize)
+        return 0;
+    resized = buffer_alloc(cells);
+    if(!resized)
+        return -ENOMEM;
+    for(; taken < oldSize - size; taken++){ //shrinking, the slots we cut off have to be free
+        if(down_trylock(&empty)){
+            while(taken--)
+                up(&empty);
+            kfree(resized);
+            printk(KERN_ERR "buffSize can't go down to %d while the buffer holds more than that\n", size);
+            return -EBUSY;
+        }
+    }
+    down(&mutex); //nobody touches the buffer until we are done
+    for(unsigned long pos = headCount; pos != tailCount; pos++)
+        resized[ring_wrap(pos, size, cells - 1)] = buffer[buffer_slot(pos)];
+    old = buffer;
+    buffer = resized;
+    ringMask = cells - 1;
+    WRITE_ONCE(buffSize, size);
+    up(&mutex);
+    for(int i = oldSize; i < size; i++) //growing, the new slots are free
+        up(&empty);
+    kfree(old);
+    printk(KERN_INFO "buffSize changed from %d to %d\n", oldSize, size);
+    return 0;
+}
+
+// n consumers from now on, see above
+static int consumers_resize(int n){
+    int oldCons = cons;
+    int err;
+
+    if(ringMode == RING_SHARDED){
+        printk(KERN_ERR "cons can't be changed while loaded with ringMode 2\n");
+        return -EBUSY;
+    }
+    if(n < 0 || n > consMax){
+        printk(KERN_ERR "cons must be between 0 and consMax (%d)\n", consMax);
+        return -EINVAL;
+    }
+    spin_lock(&consLock);
+    WRITE_ONCE(cons, n);
+    for(int i = n; i < oldCons; i++){ //wake the ones that go, see above
+        if(ringMode == RING_SEMAPHORE && consumerThreads[i] && !consumerStats[i].retired){
+            atomic_inc(&retireWakes);
+            up(&full);
+        }
+    }
+    spin_unlock(&consLock);
+    if(n < oldCons && ringMode == RING_LOCKFREE)
+        wake_up_all(&lfRing.notEmpty);
+    if(n > consSeen)
+        WRITE_ONCE(consSeen, n); //before they start, exit has to wake them all
+    for(int i = oldCons; i < n; i++){
+        struct consumer_stats *c = &consumerStats[i];
+        if(consumerThreads[i] && !c->retired) //hadn't gotten around to exiting, it just keeps going
+            continue;
+        if(consumerThreads[i]){ //gone, join it before its context gets a new thread
+            struct task_struct *gone = consumerThreads[i];
+            WRITE_ONCE(consumerThreads[i], NULL); //bench_report skips it from now on
+            kthread_stop(gone);
+            put_task_struct(gone);
+        }
+        c->retired = false;
+        err = start_thread(kthread_consumer, c, thread_cpu(consMask, i), c->name, &consumerThreads[i]);
+        if(err){
+            spin_lock(&consLock);
+            WRITE_ONCE(cons, i); //the ones we did start stay
+            spin_unlock(&consLock);
+            printk(KERN_INFO "ERROR: Cannot create thread %s\n", c->name);
+            return err;
+        }
+    }
+    printk(KERN_INFO "cons changed from %d to %d\n", oldCons, n);
+    return 0;
+}
+
+// parameter write: plain parsing at load, a resize once we are running
+static int resize_param(const char *val, const struct kernel_param *kp, int (*resize)(int)){
+    int n, ret;
+
+    mutex_lock(&resizeMutex);
+    if(!initStarted){
+        ret = param_set_int(val, kp); //init checks it
+    } else if(!resizeReady){
+        ret = -EBUSY;
+    } else {
+        ret = kstrtoint(val, 0, &n);
+        if(!ret)
+            ret = resize(n);
+    }
+    mutex_unlock(&resizeMutex);
+    return ret;
+}
+
+static int buff_size_set(const char *val, const struct kernel_param *kp){
+    return resize_param(val, kp, buffer_resize);
+}
+
+static int cons_set(const char *val, const struct kernel_param *kp){
+    return resize_param(val, kp, consumers_resize);
+}
+
+// Module exit function ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void __exit producer_consumer_exit(void){
+    /* clean up tasks
+        1. tell every thread to stop
+        2. signal semaphores and queues to wake up threads
+        3. join all producers and consumers
+        4. free memory
+    */
+    WRITE_ONCE(resizeReady, false); //writes from now on get -EBUSY
+    mutex_lock(&resizeMutex); //and no resize is still running after this
+    mutex_unlock(&resizeMutex);
+    proc_remove(statsProc); //first, so nobody is reading the counters we free below
+
+    stop_all_threads(); //1-3, see Teardown
+    proc_remove(doneProc); //its readers were woken above
+    proc_remove(exportProc); //same, existing mappings keep their pages
+
+    if(consSeen > 0){ //threads are stopped so their counters are final
+        u64 *hist = kmalloc_array(LAT_BUCKETS, sizeof(u64), GFP_KERNEL);
+        if(hist){
+            u64 total = lat_merge(hist);
+            printk(KERN_INFO "Queue latency over %llu items p50: %llu ns p99: %llu ns p999: %llu ns\n", total,
+                lat_percentile(hist, total, 500), lat_percentile(hist, total, 990), lat_percentile(hist, total, 999));
+            kfree(hist);
+        }
+    }
+    consumerOps->report(NULL); //the handler's summary, with the elapsed handler the line test.sh looks for
+    proc_remove(traceProc); //no readers left once this returns
+    trace_free();
+
+    buffer_release(); //items still in the buffer may hold task references
+    kfree(subRings); //NULL unless ringMode 2
+    kfree(buffer); //we release the buffer in memory
+    kfree(consumerThreads); //we release consumer threads in memory, NULL if consMax was 0
+    kfree(producerThreads); //NULL if prod was 0
+    fork_probe_exit(); //producers are gone, drops what the probe queued since their last pass
+    contexts_free(); //contexts, their pool and the seen cache
+    export_free();
+    placement_free();
 
 }
 
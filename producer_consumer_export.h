@@ -0,0 +1,51 @@
+/* Export ring layout ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    What mmap of /proc/producer_consumer_export looks like, shared by the
+    module and export_read/export_read.c (so only fixed size types in here).
+
+    The first page is a pc_export_info. After it there is one ring per
+    consumer context (consMax of them), ringStride bytes apart starting at
+    ringOffset. Every ring is a header page and then records records, which
+    is a power of two, so record n is at (n & (records - 1)).
+
+    Each ring has one writer (its consumer) and one reader:
+        head: records written so far, only the module writes it. Read it with
+            an acquire load, the records below it are complete.
+        tail: records read so far, only the reader writes it. Store it with
+            a release once you are done with the records below it, the module
+            won't write over a record until tail has gone past it.
+        lost: records the module had to drop because the ring was full.
+    Both counters only go up, head - tail is what is waiting to be read.
+*/
+#ifndef _PRODUCER_CONSUMER_EXPORT_H
+#define _PRODUCER_CONSUMER_EXPORT_H
+
+#include <linux/types.h>
+
+#define PC_EXPORT_MAGIC 0x70636578 //"pcex"
+
+struct pc_export_info {
+    __u32 magic; //PC_EXPORT_MAGIC
+    __u32 rings; //one per consumer, ring i belongs to Consumer-(i+1)
+    __u32 records; //per ring, a power of two
+    __u32 recordSize; //sizeof(struct pc_export_record)
+    __u64 ringOffset; //bytes from the start of the mapping to ring 0
+    __u64 ringStride; //bytes from one ring to the next
+    __u64 recordOffset; //bytes from the start of a ring to its first record
+};
+
+struct pc_export_ring_header {
+    __u64 head; //module writes
+    __u64 lost; //module writes
+    __u64 tail __attribute__((aligned(64))); //reader writes, own cacheline so the two sides don't bounce
+};
+
+struct pc_export_record {
+    __u64 elapsed_ns; //elapsed time of the task when it was consumed
+    __u64 cpu_ns; //utime + stime with cpuTime, 0 otherwise
+    __s32 pid; //0 for a bench item
+    __u32 uid;
+    __u32 consumer; //N of Consumer-N
+    __u32 reserved;
+};
+
+#endif
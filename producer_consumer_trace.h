@@ -0,0 +1,86 @@
+/* Tracepoints for producer_consumer ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    Static TRACE_EVENTs around every blocking point in the threads so we can see
+    how long each one waits and on what, without rebuilding with debug prints.
+
+    trace-cmd record -e producer_consumer
+    perf record -e 'producer_consumer:*'
+
+    When nothing is listening the events are static-key nops, and the module only
+    reads the clock if trace_pc_wait_enabled() says someone is.
+*/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM producer_consumer
+
+// what a thread was waiting on, shared with producer_consumer.c
+#ifndef _PRODUCER_CONSUMER_TRACE_DEFS
+#define _PRODUCER_CONSUMER_TRACE_DEFS
+#define PC_WAIT_EMPTY 0 //semaphore empty
+#define PC_WAIT_FULL 1 //semaphore full
+#define PC_WAIT_MUTEX 2 //semaphore mutex
+#define PC_WAIT_NOT_FULL 3 //lock-free ring wait queue, producer side
+#define PC_WAIT_NOT_EMPTY 4 //lock-free ring wait queue, consumer side
+#endif
+
+#if !defined(_PRODUCER_CONSUMER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _PRODUCER_CONSUMER_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+
+#define show_pc_wait(what) __print_symbolic(what, \
+    { PC_WAIT_EMPTY, "empty" }, \
+    { PC_WAIT_FULL, "full" }, \
+    { PC_WAIT_MUTEX, "mutex" }, \
+    { PC_WAIT_NOT_FULL, "ring_not_full" }, \
+    { PC_WAIT_NOT_EMPTY, "ring_not_empty" })
+
+// a thread came back from down_interruptible or a ring wait queue
+TRACE_EVENT(pc_wait,
+    TP_PROTO(int what, u64 wait_ns, unsigned long occupancy, int ret),
+    TP_ARGS(what, wait_ns, occupancy, ret),
+    TP_STRUCT__entry(
+        __array(char, comm, TASK_COMM_LEN)
+        __field(u64, wait_ns)
+        __field(unsigned long, occupancy)
+        __field(int, what)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        memcpy(__entry->comm, current->comm, TASK_COMM_LEN);
+        __entry->wait_ns = wait_ns;
+        __entry->occupancy = occupancy;
+        __entry->what = what;
+        __entry->ret = ret;
+    ),
+    TP_printk("thread=%s on=%s wait_ns=%llu occupancy=%lu ret=%d",
+        __entry->comm, show_pc_wait(__entry->what), __entry->wait_ns,
+        __entry->occupancy, __entry->ret)
+);
+
+// a thread released one of the semaphores
+TRACE_EVENT(pc_up,
+    TP_PROTO(int what, unsigned long occupancy),
+    TP_ARGS(what, occupancy),
+    TP_STRUCT__entry(
+        __array(char, comm, TASK_COMM_LEN)
+        __field(unsigned long, occupancy)
+        __field(int, what)
+    ),
+    TP_fast_assign(
+        memcpy(__entry->comm, current->comm, TASK_COMM_LEN);
+        __entry->occupancy = occupancy;
+        __entry->what = what;
+    ),
+    TP_printk("thread=%s sem=%s occupancy=%lu",
+        __entry->comm, show_pc_wait(__entry->what), __entry->occupancy)
+);
+
+#endif /* _PRODUCER_CONSUMER_TRACE_H */
+
+// the header isn't in include/trace/events, so tell define_trace.h where it is
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE producer_consumer_trace
+#include <trace/define_trace.h>
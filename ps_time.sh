@@ -1,4 +1,9 @@
 #!/bin/bash
+# ps_time/ps_time does the same in one pass over /proc (and has -n for ns), use it once it is built
+native="$(dirname "$0")/ps_time/ps_time"
+if [ -x "$native" ]; then
+	exec "$native" "$@"
+fi
 let TIME=0
 etimes=$(ps -u $1 -o etimes= | awk '{print $1}')
 etimesList=($etimes)
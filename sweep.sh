@@ -0,0 +1,70 @@
+#!/bin/bash
+# Runs the module once for every combination of buffSize, cons, batch and ringMode
+# against the same set of processes and prints one CSV line per run
+#
+# usage: sudo ./sweep.sh <Number of processes to be spawned> [csv file]
+# the lists can be changed from the environment, e.g.
+#   BUFF_SIZES="10 100" CONS_LIST="1 4 16" sudo -E ./sweep.sh 1000 out.csv
+export num=$1
+out=${2:-/dev/stdout}
+BUFF_SIZES=${BUFF_SIZES:-"10 50 500"}
+CONS_LIST=${CONS_LIST:-"1 2 4 8"}
+BATCHES=${BATCHES:-"1 16"}
+RING_MODES=${RING_MODES:-"0 1 2"}
+PROD=${PROD:-1}
+LOG_MODE=${LOG_MODE:-1} # trace buffer, so printk doesn't decide the numbers
+TIMEOUT=${TIMEOUT:-60} # seconds one run may take before we give up on it
+
+if [ -z "$num" ]; then
+    echo "usage: $0 <Number of processes to be spawned> [csv file]" >&2
+    exit 1
+fi
+
+echo $num > var
+name="test_cse330"
+useradd $name
+passwd -d $name
+uid=$(id -u $name)
+make clean > /dev/null
+make > /dev/null || exit 1
+
+# same population for every run, started once
+echo "Sweep will start $num processes for the user $uid" >&2
+su $name -c ./process_gen/process_generator > /dev/null &
+# comm is cut to 15 characters, so that is what pgrep -x has to match
+while [ "$(pgrep -c -u $uid -x process_generat)" -lt $((num + 1)) ]; do # children + the parent
+    sleep 0.2
+done
+
+echo "ringMode,buffSize,prod,cons,batch,status,items,wall_ns,items_per_sec,p99_ns" > $out
+for ring in $RING_MODES; do
+for size in $BUFF_SIZES; do
+for cons in $CONS_LIST; do
+for batch in $BATCHES; do
+    if [ $ring -eq 2 ] && [ $size -lt $cons ]; then # every consumer needs its own sub-ring
+        continue
+    fi
+    start=$(date +%s%N)
+    insmod producer_consumer.ko buffSize=$size prod=$PROD cons=$cons batch=$batch ringMode=$ring uuid=$uid logMode=$LOG_MODE || continue
+    done_line=$(timeout $TIMEOUT cat /proc/producer_consumer_done)
+    end=$(date +%s%N)
+    stats=$(cat /proc/producer_consumer)
+    rmmod producer_consumer
+
+    wall=$((end - start))
+    if [[ $done_line == done* ]]; then
+        status=done
+        items=$(echo "$done_line" | awk '{print $5}')
+    else
+        status=timeout
+        items=$(echo "$stats" | awk '/^produced:/ {print $4}')
+    fi
+    p99=$(echo "$stats" | awk '/^queue latency p50:/ {print $7}')
+    rate=$((items * 1000000000 / wall))
+    echo "$ring,$size,$PROD,$cons,$batch,$status,$items,$wall,$rate,$p99" >> $out
+done
+done
+done
+done
+
+pkill -u $uid; rm -rf var;
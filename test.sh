@@ -16,8 +16,8 @@ let OUTPUT
 OUTPUT="$PS_SCRIPT";
 echo "Test script will insert the test kernel module"
 insmod producer_consumer.ko buffSize=$2 prod=$3 cons=$4 uuid=$uid &&
-echo "The test script waits 10 seconds for the kernel module to finish"
-sleep 10
+echo "The test script waits (up to 10 seconds) for the kernel module to finish"
+timeout 10 cat /proc/producer_consumer_done # returns as soon as every item is consumed
 echo "Test script will remove the test kernel module"
 rmmod producer_consumer;
 echo "The following is the dmesg output"